@@ -0,0 +1,105 @@
+// Copyright Taylor Pospisil 2018.
+// Distributed under MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef ARROW_DATA_GUARD
+#define ARROW_DATA_GUARD
+#include <stdint.h>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include "Matrix.h"
+
+// Structures of the Arrow C data interface; see
+// https://arrow.apache.org/docs/format/CDataInterface.html. Defined
+// here so that no Arrow library is needed.
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+  const char* format;
+  const char* name;
+  const char* metadata;
+  int64_t flags;
+  int64_t n_children;
+  struct ArrowSchema** children;
+  struct ArrowSchema* dictionary;
+  void (*release)(struct ArrowSchema*);
+  void* private_data;
+};
+
+struct ArrowArray {
+  int64_t length;
+  int64_t null_count;
+  int64_t offset;
+  int64_t n_buffers;
+  int64_t n_children;
+  const void** buffers;
+  struct ArrowArray** children;
+  struct ArrowArray* dictionary;
+  void (*release)(struct ArrowArray*);
+  void* private_data;
+};
+
+#endif  // ARROW_C_DATA_INTERFACE
+
+inline MatrixView arrow_view(const ArrowSchema* schema,
+                             const ArrowArray* array,
+                             std::vector<const void*>& columns) {
+  // Views an Arrow array without copying.
+  //
+  // A struct array (such as an exported record batch) gives a column
+  // for each child and any other array a single column. Every column
+  // must be float64 or float32, all of the same type, without nulls.
+  //
+  // Arguments:
+  //   schema: schema of the array.
+  //   array: the array; must outlive the view.
+  //   columns: filled with the start of each column's values.
+  //
+  // Returns: a view of the array as a matrix with array -> length
+  //   rows.
+  //
+  // Throws: std::invalid_argument for unsupported arrays.
+  std::vector<const ArrowSchema*> schemas;
+  std::vector<const ArrowArray*> arrays;
+  if (std::strcmp(schema -> format, "+s") == 0) {
+    for (int64_t jj = 0; jj < schema -> n_children; jj++) {
+      schemas.push_back(schema -> children[jj]);
+      arrays.push_back(array -> children[jj]);
+    }
+  } else {
+    schemas.push_back(schema);
+    arrays.push_back(array);
+  }
+  if (schemas.empty()) {
+    throw std::invalid_argument("Arrow array has no columns");
+  }
+
+  int dtype = std::strcmp(schemas[0] -> format, "f") == 0 ? FLOAT32 : FLOAT64;
+  const char* format = dtype == FLOAT32 ? "f" : "g";
+  size_t item_size = dtype == FLOAT32 ? sizeof(float) : sizeof(double);
+
+  columns.clear();
+  for (size_t jj = 0; jj < schemas.size(); jj++) {
+    if (std::strcmp(schemas[jj] -> format, format) != 0) {
+      throw std::invalid_argument("Arrow columns must all be float64 or all float32");
+    }
+    const ArrowArray* column = arrays[jj];
+    if (column -> null_count != 0 && column -> buffers[0] != NULL) {
+      throw std::invalid_argument("Arrow columns must not contain nulls");
+    }
+    // Offsets of a struct array apply to its children as well.
+    int64_t offset = column -> offset;
+    if (column != array) { offset += array -> offset; }
+    const char* values = static_cast<const char*>(column -> buffers[1]);
+    columns.push_back(values + offset * item_size);
+  }
+
+  return MatrixView::column_buffers(columns.data(), dtype);
+}
+
+#endif
@@ -0,0 +1,256 @@
+// Copyright Taylor Pospisil 2018.
+// Distributed under MIT License (http://opensource.org/licenses/MIT)
+
+#include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "Codegen.h"
+#include "helpers.h"
+
+namespace {
+  const uint64_t fnv_offset = 14695981039346656037ULL;
+
+  uint64_t hash_ints(uint64_t hash, const std::vector<int>& values) {
+    std::vector<double> tmp(values.begin(), values.end());
+    return hash_values(hash, tmp.data(), tmp.size());
+  }
+
+  void write_literal(std::ostream& out, double value) {
+    // Writes a double so that it is read back exactly.
+    if (std::isinf(value)) {
+      out << (value < 0 ? "-HUGE_VAL" : "HUGE_VAL");
+    } else {
+      out << value;
+    }
+  }
+
+  void write_literal(std::ostream& out, int value) {
+    out << value;
+  }
+
+  // Trees within both limits become nested conditions with inlined
+  // thresholds; larger trees become tables walked by a loop, which
+  // keeps the source linear in the nodes and shallow for compilers.
+  const int max_nested_depth = 24;
+  const int max_nested_nodes = 1024;
+
+  int flat_depth(const Tree& tree) {
+    // Depth of the deepest internal node; nodes are in pre-order so
+    // parents precede their children.
+    if (tree.flat_var.empty()) { return 0; }
+    std::vector<int> depth(tree.flat_var.size(), 0);
+    int max_depth = 0;
+    for (size_t node = 0; node < tree.flat_var.size(); node++) {
+      max_depth = std::max(max_depth, depth[node]);
+      if (tree.flat_le[node] >= 0) { depth[tree.flat_le[node]] = depth[node] + 1; }
+      if (tree.flat_gt[node] >= 0) { depth[tree.flat_gt[node]] = depth[node] + 1; }
+    }
+    return max_depth;
+  }
+
+  bool use_tables(const Tree& tree) {
+    return static_cast<int>(tree.flat_var.size()) > max_nested_nodes ||
+      flat_depth(tree) > max_nested_depth;
+  }
+
+  void feature_columns(const Tree& tree, int var, int n_var, int zero_col,
+                       int& hi, int& lo) {
+    // Columns of the row buffer whose difference is a block feature,
+    // matching Tree::calculate_feature; the buffer holds the
+    // covariates, then the prefix sums, then a zero.
+    int prefix_lo = tree.prefix_lo[var];
+    if (prefix_lo < 0) {
+      hi = tree.starts[var];
+      lo = zero_col;
+    } else {
+      hi = n_var + prefix_lo + tree.ends[var] - tree.starts[var];
+      lo = n_var + prefix_lo;
+    }
+  }
+
+  void write_node(std::ostream& out, const Tree& tree, int node, int depth,
+                  int n_var, int zero_col) {
+    // Writes the nested conditions of the subtree rooted at a flat
+    // node index or ~leaf_id.
+    std::string indent(2 * depth, ' ');
+    if (node < 0) {
+      out << indent << "return " << ~node << ";\n";
+      return;
+    }
+    int hi, lo;
+    feature_columns(tree, tree.flat_var[node], n_var, zero_col, hi, lo);
+    out << indent << "if (";
+    if (lo == zero_col) {
+      out << "v[" << hi << "]";
+    } else {
+      out << "(v[" << hi << "] - v[" << lo << "])";
+    }
+    out << " <= ";
+    write_literal(out, tree.flat_value[node]);
+    out << ") {\n";
+    write_node(out, tree, tree.flat_le[node], depth + 1, n_var, zero_col);
+    out << indent << "} else {\n";
+    write_node(out, tree, tree.flat_gt[node], depth + 1, n_var, zero_col);
+    out << indent << "}\n";
+  }
+
+  template<class T>
+  void write_table(std::ostream& out, const char* type, int tree,
+                   const char* name, const std::vector<T>& values) {
+    // Writes a constant array named tree_<tree>_<name>.
+    out << "  const " << type << " tree_" << tree << "_" << name << "[] = {";
+    for (size_t ii = 0; ii < values.size(); ii++) {
+      out << (ii % 8 == 0 ? "\n    " : " ");
+      write_literal(out, values[ii]);
+      out << ",";
+    }
+    out << "\n  };\n";
+  }
+
+  void write_tables(std::ostream& out, const Tree& tree, int tt, int n_var,
+                    int zero_col) {
+    // Writes the node tables of a tree and a function walking them.
+    std::vector<int> hi(tree.flat_var.size());
+    std::vector<int> lo(tree.flat_var.size());
+    for (size_t node = 0; node < tree.flat_var.size(); node++) {
+      feature_columns(tree, tree.flat_var[node], n_var, zero_col, hi[node],
+                      lo[node]);
+    }
+    write_table(out, "int", tt, "hi", hi);
+    write_table(out, "int", tt, "lo", lo);
+    write_table(out, "double", tt, "value", tree.flat_value);
+    write_table(out, "int", tt, "le", tree.flat_le);
+    write_table(out, "int", tt, "gt", tree.flat_gt);
+    out << "\n  int tree_" << tt << "(const double* v) {\n"
+        << "    return walk(tree_" << tt << "_hi, tree_" << tt << "_lo, tree_"
+        << tt << "_value, tree_" << tt << "_le, tree_" << tt << "_gt, v);\n"
+        << "  }\n";
+  }
+}
+
+uint64_t structure_hash(const Forest& forest) {
+  // Hashes the splits, leaves and feature blocks of every tree so
+  // that generated code can be matched with its forest.
+  //
+  // Arguments:
+  //   forest: the trained forest.
+  //
+  // Returns: the hash.
+  uint64_t hash = fnv_offset;
+  double sizes[2] = {static_cast<double>(forest.trees.size()),
+                     static_cast<double>(forest.n_var)};
+  hash = hash_values(hash, sizes, 2);
+  for (size_t tt = 0; tt < forest.trees.size(); tt++) {
+    const Tree& tree = forest.trees[tt];
+    hash = hash_ints(hash, tree.starts);
+    hash = hash_ints(hash, tree.ends);
+    hash = hash_ints(hash, tree.prefix_lo);
+    hash = hash_ints(hash, tree.flat_var);
+    hash = hash_values(hash, tree.flat_value.data(), tree.flat_value.size());
+    hash = hash_ints(hash, tree.flat_le);
+    hash = hash_ints(hash, tree.flat_gt);
+  }
+  return hash;
+}
+
+std::string generate_source(const Forest& forest) {
+  // Writes C++ source for a shared library routing observations
+  // through a fixed forest.
+  //
+  // Each row is copied into a buffer with its prefix sums, unrolled
+  // in the order of PrefixSums::row, so that block features are
+  // bitwise equal to those of the forest. Small trees become
+  // functions of nested conditions with their thresholds inlined;
+  // trees deeper than max_nested_depth or with more than
+  // max_nested_nodes internal nodes become node tables walked by a
+  // loop.
+  //
+  // Arguments:
+  //   forest: the trained forest.
+  //
+  // Returns: the source; see Codegen.h for its exports.
+  std::ostringstream out;
+  out.precision(std::numeric_limits<double>::max_digits10);
+  int n_trees = forest.trees.size();
+  int n_var = forest.n_var;
+  int zero_col = n_var + forest.prefix.n_cols;
+
+  out << "// Generated by RFCDE from a trained forest; do not edit.\n"
+      << "#include <stdint.h>\n"
+      << "#include <cmath>\n\n"
+      << "namespace {\n"
+      << "  void fill_row(const double* x, double* v) {\n";
+  for (int var = 0; var < n_var; var++) {
+    out << "    v[" << var << "] = x[" << var << "];\n";
+  }
+  for (int cc = n_var; cc <= zero_col; cc++) {
+    out << "    v[" << cc << "] = 0.0;\n";
+  }
+  const std::vector<int>& before = forest.prefix.before;
+  for (size_t idx = 0; idx < before.size(); idx++) {
+    if (before[idx] < 0) { continue; }
+    out << "    v[" << n_var + before[idx] + 1 << "] = v[" << n_var + before[idx]
+        << "] + x[" << idx << "];\n";
+  }
+  out << "  }\n";
+
+  // The table walker is only emitted when used so that the library
+  // compiles without unused-function warnings.
+  std::vector<bool> tables(n_trees);
+  for (int tt = 0; tt < n_trees; tt++) {
+    tables[tt] = use_tables(forest.trees[tt]);
+  }
+  if (std::find(tables.begin(), tables.end(), true) != tables.end()) {
+    out << "\n"
+        << "  int walk(const int* hi, const int* lo, const double* value,\n"
+        << "           const int* le, const int* gt, const double* v) {\n"
+        << "    int node = 0;\n"
+        << "    while (node >= 0) {\n"
+        << "      node = (v[hi[node]] - v[lo[node]] <= value[node]) ?\n"
+        << "        le[node] : gt[node];\n"
+        << "    }\n"
+        << "    return ~node;\n"
+        << "  }\n";
+  }
+
+  for (int tt = 0; tt < n_trees; tt++) {
+    const Tree& tree = forest.trees[tt];
+    out << "\n";
+    if (tables[tt]) {
+      write_tables(out, tree, tt, n_var, zero_col);
+      continue;
+    }
+    out << "  int tree_" << tt << "(const double* v) {\n";
+    if (tree.flat_var.empty()) {
+      out << "    return 0;\n";
+    } else {
+      write_node(out, tree, 0, 2, n_var, zero_col);
+    }
+    out << "  }\n";
+  }
+  out << "}\n\n";
+
+  out << "extern \"C\" {\n"
+      << "int rfcde_n_trees() { return " << n_trees << "; }\n"
+      << "int rfcde_n_var() { return " << n_var << "; }\n"
+      << "uint64_t rfcde_structure() { return " << structure_hash(forest)
+      << "ULL; }\n\n"
+      << "void rfcde_apply(const double* x_test, int n_test, int* leaf_ids) {\n"
+      << "  double v[" << zero_col + 1 << "];\n"
+      << "  for (int ii = 0; ii < n_test; ii++) {\n"
+      << "    int* leaf_row = leaf_ids + static_cast<int64_t>(ii) * "
+      << n_trees << ";\n"
+      << "    fill_row(x_test + static_cast<int64_t>(ii) * " << n_var
+      << ", v);\n";
+  for (int tt = 0; tt < n_trees; tt++) {
+    out << "    leaf_row[" << tt << "] = tree_" << tt << "(v);\n";
+  }
+  out << "  }\n"
+      << "}\n"
+      << "}\n";
+  return out.str();
+}
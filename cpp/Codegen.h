@@ -0,0 +1,21 @@
+// Copyright Taylor Pospisil 2018.
+// Distributed under MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef CODEGEN_GUARD
+#define CODEGEN_GUARD
+#include <stdint.h>
+#include <string>
+#include "Forest.h"
+
+// Specializes a trained forest into C++ source for a shared library
+// exporting, with C linkage,
+//   int rfcde_n_trees();
+//   int rfcde_n_var();
+//   uint64_t rfcde_structure();
+//   void rfcde_apply(const double* x_test, int n_test, int* leaf_ids);
+// where rfcde_apply fills the same leaf ids as Forest::apply from
+// row-major covariates.
+uint64_t structure_hash(const Forest& forest);
+std::string generate_source(const Forest& forest);
+
+#endif
@@ -0,0 +1,203 @@
+// Copyright Taylor Pospisil 2018.
+// Distributed under MIT License (http://opensource.org/licenses/MIT)
+
+#include <vector>
+#include <random>
+#include <cmath>
+#include <algorithm>
+#include "Features.h"
+#include "helpers.h"
+
+void RankedColumn::encode(const double* x, int n_train) {
+  // Rank-transforms a covariate column.
+  //
+  // Tied values share a rank so that comparisons between ranks agree
+  // with comparisons between the original values.
+  //
+  // Arguments:
+  //   x: pointer to covariate column.
+  //   n_train: number of training observations.
+  //
+  // Side-Effects: populates ranks, values and n_bits.
+  std::vector<int> order(n_train);
+  for (int ii = 0; ii < n_train; ii++) { order[ii] = ii; }
+  sortby(order.begin(), order.end(), x);
+
+  ranks.resize(n_train);
+  values.clear();
+  for (auto it = order.begin(); it != order.end(); ++it) {
+    if (values.empty() || x[*it] != values.back()) {
+      values.push_back(x[*it]);
+    }
+    ranks[*it] = values.size() - 1;
+  }
+
+  n_bits = 0;
+  while (!values.empty() && ((values.size() - 1) >> n_bits)) { n_bits++; }
+}
+
+void RankedColumn::assign(const double* x, int n_train) {
+  // Keeps a covariate column unranked for random splits.
+  //
+  // Arguments:
+  //   x: pointer to covariate column.
+  //   n_train: number of training observations.
+  //
+  // Side-Effects: sets values to the column and clears ranks.
+  values.assign(x, x + n_train);
+  ranks.clear();
+  n_bits = 0;
+}
+
+void PrefixSums::build(const MatrixView& x, const int* lens, int n_train,
+                       int n_var) {
+  // Computes cumulative sums over each functional variable.
+  //
+  // Arguments:
+  //   x: view of the training covariates.
+  //   lens: lengths of the functional variables; 1 for scalars.
+  //   n_train: number of training observations.
+  //   n_var: number of training covariates.
+  //
+  // Side-Effects: populates sums and before.
+  this -> n_train = n_train;
+  before.assign(n_var, -1);
+
+  n_cols = 0;
+  for (int idx = 0, lens_id = 0; idx < n_var; idx += lens[lens_id++]) {
+    if (lens[lens_id] > 1) { n_cols += lens[lens_id] + 1; }
+  }
+  sums.assign(static_cast<size_t>(n_cols) * n_train, 0.0);
+
+  int col = 0;
+  std::vector<double> cur(n_train);
+  for (int idx = 0, lens_id = 0; idx < n_var; idx += lens[lens_id++]) {
+    if (lens[lens_id] == 1) { continue; }
+    for (int kk = 0; kk < lens[lens_id]; kk++) {
+      before[idx + kk] = col;
+      x.column(idx + kk, n_train, cur.data());
+      const double* prev = &sums[col * n_train];
+      double* next = &sums[(col + 1) * n_train];
+      for (int ii = 0; ii < n_train; ii++) { next[ii] = prev[ii] + cur[ii]; }
+      col++;
+    }
+    col++;
+  }
+}
+
+void Features::aggregate(const MatrixView& x_train, const PrefixSums& prefix,
+                         std::vector<RankedColumn>& singles,
+                         const std::vector<int>& starts,
+                         const std::vector<int>& ends, int n_train,
+                         bool ranked) {
+  // Sets up columns aggregated over blocks of covariates.
+  //
+  // Columns are only ranked when first used by column() so the cost
+  // scales with the variables evaluated rather than the number of
+  // blocks. Singleton blocks reference covariates ranked once for the
+  // forest in singles.
+  //
+  // Arguments:
+  //   x_train: view of the training covariates.
+  //   prefix: cumulative sums of the functional variables.
+  //   singles: ranked covariates; unranked entries are empty.
+  //   starts: first covariate of each block.
+  //   ends: one past the last covariate of each block.
+  //   n_train: number of training observations.
+  //   ranked: whether to rank the columns; random splits use the
+  //     raw values so that no column is sorted.
+  //
+  // Side-Effects: resets columns to be materialized lazily.
+  this -> x_train = x_train;
+  this -> prefix = &prefix;
+  this -> singles = &singles;
+  this -> starts = starts.data();
+  this -> ends = ends.data();
+  this -> n_train = n_train;
+  this -> ranked = ranked;
+
+  int n_var = starts.size();
+  columns.assign(n_var, NULL);
+  owned.resize(n_var);
+  vars.resize(n_var);
+  for (int ii = 0; ii < n_var; ii++) { vars[ii] = ii; }
+  rng = NULL;
+}
+
+void Features::materialize(int var) {
+  // Ranks, or keeps unranked, the aggregated column for a block.
+  //
+  // Singleton blocks rank the caller's covariate in place, once for
+  // the forest; other blocks are differences of prefix sums.
+  //
+  // Arguments:
+  //   var: index of the block.
+  //
+  // Side-Effects: points columns[var] at the ranked column, encoding
+  //   it on first use.
+  values.resize(n_train);
+  if (ends[var] - starts[var] == 1) {
+    RankedColumn& single = (*singles)[starts[var]];
+    if (single.empty()) {
+      x_train.column(starts[var], n_train, values.data());
+      single.build(values.data(), n_train, ranked);
+    }
+    columns[var] = &single;
+  } else {
+    prefix -> aggregate(starts[var], ends[var], values.data());
+    owned[var].build(values.data(), n_train, ranked);
+    columns[var] = &owned[var];
+  }
+}
+
+void Partition::singletons(int n_var) {
+  // Places each covariate in its own block.
+  //
+  // Arguments:
+  //   n_var: number of training covariates.
+  //
+  // Side-Effects: populates starts and ends.
+  starts.resize(n_var);
+  ends.resize(n_var);
+  for (int ii = 0; ii < n_var; ii++) {
+    starts[ii] = ii;
+    ends[ii] = ii + 1;
+  }
+}
+
+void Partition::draw(const int* lens, int n_var, double flambda,
+                     std::default_random_engine& rng) {
+  // Randomly partitions each functional variable into blocks.
+  //
+  // Block lengths are zero-truncated Pois(flambda) draws capped by
+  // the remaining length of the functional variable. Draws are exact
+  // rather than rejecting zeros so that small flambda does not spin:
+  // the first arrival t of a Poisson process on [0, 1] given at least
+  // one arrival is drawn by inversion and the remaining arrivals are
+  // Pois(flambda * (1 - t)).
+  //
+  // Arguments:
+  //   lens: lengths of the functional variables; 1 for scalars.
+  //   n_var: number of training covariates.
+  //   flambda: mean of the Poisson block lengths.
+  //   rng: random engine.
+  //
+  // Side-Effects: populates starts and ends.
+  std::uniform_real_distribution<double> runif(0.0, 1.0);
+  double p_arrival = -std::expm1(-flambda);
+
+  starts.clear();
+  ends.clear();
+  for (int idx = 0, lens_id = 0; idx < n_var; idx += lens[lens_id++]) {
+    int end = idx + lens[lens_id];
+    for (int start = idx; start < end; ) {
+      double t = -std::log1p(-runif(rng) * p_arrival) / flambda;
+      std::poisson_distribution<int> rpois(flambda * std::max(0.0, 1.0 - t));
+      int jump = std::min(1 + rpois(rng), end - start);
+
+      starts.push_back(start);
+      ends.push_back(start + jump);
+      start += jump;
+    }
+  }
+}
@@ -0,0 +1,115 @@
+// Copyright Taylor Pospisil 2018.
+// Distributed under MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef FEATURES_GUARD
+#define FEATURES_GUARD
+#include <stdint.h>
+#include <cstddef>
+#include <vector>
+#include <random>
+#include "Matrix.h"
+
+class RankedColumn {
+ public:
+  std::vector<uint32_t> ranks; // dense rank of each training observation.
+  // Sorted distinct values; values[ranks[ii]] == x[ii]. Columns kept
+  // unranked for random splits hold x itself and no ranks.
+  std::vector<double> values;
+  int n_bits; // number of bits needed to represent the largest rank.
+
+  void encode(const double* x, int n_train);
+  void assign(const double* x, int n_train);
+
+  void build(const double* x, int n_train, bool ranked) {
+    if (ranked) {
+      encode(x, n_train);
+    } else {
+      assign(x, n_train);
+    }
+  }
+
+  bool empty() const {
+    return values.empty();
+  }
+
+  double value(int idx) const {
+    return values[ranks[idx]];
+  }
+};
+
+class Partition {
+ public:
+  // Blocks [starts[ii], ends[ii]) of covariates aggregated into a
+  // single feature.
+  std::vector<int> starts;
+  std::vector<int> ends;
+
+  void singletons(int n_var);
+  void draw(const int* lens, int n_var, double flambda,
+            std::default_random_engine& rng);
+};
+
+class PrefixSums {
+ public:
+  // Cumulative sums of each functional variable (column-major); the
+  // column before[idx] holds the sum of the covariates preceding idx
+  // in its functional variable, starting from a column of zeros.
+  std::vector<double> sums;
+  std::vector<int> before; // -1 for scalar covariates.
+  int n_cols; // number of prefix columns.
+  int n_train;
+
+  PrefixSums() : n_cols(0), n_train(0) {}
+
+  void build(const MatrixView& x, const int* lens, int n_train, int n_var);
+
+  void row(const double* x_test, std::vector<double>& out) const {
+    // Fills out with the prefix sums of a new observation using the
+    // same order of additions as for the training observations.
+    out.assign(n_cols, 0.0);
+    for (size_t idx = 0; idx < before.size(); idx++) {
+      if (before[idx] < 0) { continue; }
+      out[before[idx] + 1] = out[before[idx]] + x_test[idx];
+    }
+  }
+
+  void aggregate(int start, int end, double* out) const {
+    // Fills out with the sum of covariates [start, end) for each
+    // training observation.
+    const double* lo = &sums[before[start] * n_train];
+    const double* hi = &sums[(before[start] + end - start) * n_train];
+    for (int ii = 0; ii < n_train; ii++) { out[ii] = hi[ii] - lo[ii]; }
+  }
+};
+
+class Features {
+ public:
+  // Column for each variable; NULL until first used.
+  std::vector<const RankedColumn*> columns;
+  std::vector<RankedColumn> owned; // storage for aggregated columns.
+  std::vector<int> vars; // permutation of variables for drawing candidates.
+  std::vector<int> buffer; // scratch space for radix sorts.
+  std::vector<double> values; // scratch space for aggregated covariates.
+  std::default_random_engine* rng; // engine of the tree being grown.
+
+  MatrixView x_train;
+  const PrefixSums* prefix;
+  std::vector<RankedColumn>* singles; // ranked covariates shared by the forest.
+  const int* starts;
+  const int* ends;
+  int n_train;
+  bool ranked; // false for random splits, which use raw values.
+
+  void aggregate(const MatrixView& x_train, const PrefixSums& prefix,
+                 std::vector<RankedColumn>& singles,
+                 const std::vector<int>& starts,
+                 const std::vector<int>& ends, int n_train, bool ranked);
+  void materialize(int var);
+
+  const RankedColumn& column(int var) {
+    if (columns[var] == NULL) { materialize(var); }
+    return *columns[var];
+  }
+};
+
+#endif
@@ -2,19 +2,100 @@
 // Distributed under MIT License (http://opensource.org/licenses/MIT)
 
 #include <random>
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <stdexcept>
+#include <sstream>
+#include <string>
+#include <thread>
 #include "Forest.h"
 #include "Tree.h"
+#include "Lockstep.h"
+#include "helpers.h"
+#include "Serialize.h"
 
-void Forest::train(double* x_train, double* z_basis, int* lens, int n_train,
-                   int n_var,
+// Sharded training forks worker processes where available and
+// otherwise trains in-process.
+#if defined(__unix__) || defined(__APPLE__)
+#define RFCDE_FORK
+#include <cerrno>
+#include <csignal>
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace {
+  const char magic[] = "RFCDE";
+  const uint32_t format_version = 2;
+  const uint64_t fnv_offset = 14695981039346656037ULL;
+
+  uint64_t update_fingerprint(uint64_t hash, const MatrixView& x_train,
+                              const MatrixView& z_basis, int n_train,
+                              int n_var, int n_basis, int first) {
+    // Continues the fingerprint over rows [first, n_train) so that
+    // adding observations only hashes the new rows.
+    std::vector<double> x_row(n_var);
+    std::vector<double> z_row(n_basis);
+    for (int ii = first; ii < n_train; ii++) {
+      x_train.row(ii, n_var, x_row.data());
+      z_basis.row(ii, n_basis, z_row.data());
+      hash = hash_values(hash, x_row.data(), n_var);
+      hash = hash_values(hash, z_row.data(), n_basis);
+    }
+    return hash;
+  }
+
+  void check_basis(const MatrixView& z_basis, int n_train) {
+    // Split searches index basis evaluations as contiguous columns;
+    // columns may be padded so that appended rows fit in place.
+    if (z_basis.columns != NULL || z_basis.row_stride != 1 ||
+        z_basis.col_stride < n_train) {
+      throw std::invalid_argument("Basis evaluations must be column-major");
+    }
+  }
+
+  void save_trees(std::ostream& out, const std::vector<Tree>& trees) {
+    uint64_t n_trees = trees.size();
+    write_value(out, n_trees);
+    for (auto &tree : trees) {
+      tree.save(out);
+    }
+  }
+
+  void load_trees(std::istream& in, std::vector<Tree>& trees,
+                  const Forest& forest) {
+    // Trees are read one at a time so that a corrupt count runs out
+    // of stream rather than allocating.
+    uint64_t n_trees;
+    read_value(in, n_trees);
+    std::vector<Tree> loaded;
+    for (uint64_t tt = 0; tt < n_trees; tt++) {
+      loaded.push_back(Tree());
+      loaded.back().load(in, forest.n_train, forest.n_var,
+                         forest.prefix.n_cols, forest.n_basis);
+    }
+    trees.swap(loaded);
+  }
+}
+
+void Forest::train(const MatrixView& x_train, const MatrixView& z_basis,
+                   int* lens, int n_train, int n_var,
                    int n_basis, int n_trees, int mtry, int node_size,
-                   double min_loss_delta, double flambda, bool fit_oob) {
+                   double min_loss_delta, double flambda, bool fit_oob,
+                   int split_mode, int n_thresholds, double sample_fraction,
+                   int n_partitions, int max_depth, int max_leaf_nodes,
+                   double max_time, int seed, int n_workers) {
   // Trains a Forest object on training covariates and responses.
   //
   // Arguments:
-  //   x_train: pointer to training covariates.
-  //   z_basis: pointer to evaluations of basis functions on training
-  //     covariates.
+  //   x_train: view of the training covariates; kept for add_trees.
+  //   lens: lengths of the functional variables; 1 for scalars.
+  //   z_basis: view of evaluations of basis functions on training
+  //     responses (column-major, float or double); kept for
+  //     add_trees. Sums over the evaluations are accumulated in
+  //     double either way.
   //   n_train: number of training observations.
   //   n_var: number of training covariates.
   //   n_basis: number of training basis functions.
@@ -25,34 +106,858 @@ void Forest::train(double* x_train, double* z_basis, int* lens, int n_train,
   //   fit_oob: boolean whether to fit out-of-bag samples. Allows
   //     estimation of out-of-bag loss at the cost of increased
   //     computational effort.
+  //   split_mode: a SplitMode; BEST_SPLIT evaluates every split point
+  //     while RANDOM_SPLIT evaluates n_thresholds random thresholds
+  //     per variable on the raw covariates, which are never ranked
+  //     or sorted.
+  //   n_thresholds: number of thresholds drawn for random splits.
+  //   sample_fraction: fraction of observations drawn without
+  //     replacement for each tree; non-positive values use Pois(1)
+  //     bootstrap weights instead.
+  //   n_partitions: number of partitions of the functional variables
+  //     shared by the trees; aggregated features of each partition
+  //     are ranked once and reused by every tree drawing it. Zero
+  //     draws a new partition for each tree.
+  //   max_depth: maximum depth of each tree; 0 for no limit.
+  //   max_leaf_nodes: maximum number of leaves of each tree, grown
+  //     best-first; 0 for no limit.
+  //   max_time: wall-clock budget in seconds after which no further
+  //     trees are added; at least one tree is trained. Non-positive
+  //     values give no limit.
+  //   seed: seed of the random streams; tree ii draws from a stream
+  //     seeded by (seed, ii).
+  //   n_workers: number of forked worker processes training disjoint
+  //     ranges of trees; 1 trains in-process.
   //
   // Side-Effects: populates trees with fitted trees.
-  trees.resize(n_trees);
+  check_basis(z_basis, n_train);
+  this -> x_train = x_train;
+  this -> z_basis = z_basis;
+  this -> n_train = n_train;
+  this -> n_var = n_var;
+  this -> n_basis = n_basis;
+  this -> mtry = mtry;
+  this -> node_size = node_size;
+  this -> min_loss_delta = min_loss_delta;
+  this -> flambda = flambda;
   this -> fit_oob = fit_oob;
+  this -> split_mode = split_mode;
+  this -> n_thresholds = n_thresholds;
+  this -> sample_fraction = sample_fraction;
+  this -> max_depth = max_depth;
+  this -> max_leaf_nodes = max_leaf_nodes;
+  this -> seed = seed;
+
+  this -> fingerprint = update_fingerprint(fnv_offset, x_train, z_basis,
+                                           n_train, n_var, n_basis, 0);
+
+  this -> lens.clear();
+  for (int idx = 0, lens_id = 0; idx < n_var; idx += lens[lens_id++]) {
+    this -> lens.push_back(lens[lens_id]);
+  }
+
+  // Every tree uses the covariates themselves when there are no
+  // functional variables.
+  bool all_scalar = true;
+  for (auto len : this -> lens) {
+    if (len != 1) { all_scalar = false; }
+  }
+
+  // The pool is drawn from its own stream so that it does not depend
+  // on the number of trees.
+  std::seed_seq seq {seed};
+  std::default_random_engine rng(seq);
+
+  pool.clear();
+  partitions.clear();
+  if (all_scalar) {
+    n_partitions = 1;
+    partitions.resize(1);
+    partitions[0].singletons(n_var);
+  } else {
+    partitions.resize(n_partitions);
+    for (int kk = 0; kk < n_partitions; kk++) {
+      partitions[kk].draw(lens, n_var, flambda, rng);
+    }
+  }
+  pool.resize(n_partitions);
+  prepare_features();
+
+  trees.clear();
+  next_tree = 0;
+  if (n_workers > 1) {
+    add_trees_forked(n_trees, max_time, n_workers);
+  } else {
+    add_trees(n_trees, max_time);
+  }
+}
+
+void Forest::prepare_features() {
+  // Sets up the features shared by the trees for the training data.
+  //
+  // Covariates used as singleton blocks are ranked once for all
+  // trees; aggregated blocks are differences of prefix sums computed
+  // once for all trees.
+  //
+  // Side-Effects: rebuilds prefix and resets singles and pool.
+  singles.clear();
+  singles.resize(n_var);
+  prefix = PrefixSums();
+  prefix.build(x_train, lens.data(), n_train, n_var);
+
+  for (size_t kk = 0; kk < pool.size(); kk++) {
+    pool[kk].aggregate(x_train, prefix, singles, partitions[kk].starts,
+                       partitions[kk].ends, n_train,
+                       split_mode != RANDOM_SPLIT);
+  }
+}
+
+int Forest::add_trees(int n_trees, double max_time) {
+  // Trains additional trees on the training data of train.
+  //
+  // Each tree draws from a random stream seeded by (seed, ii) for
+  // the next unused index ii so that adding trees in several calls
+  // grows the same forest as a single call to train.
+  //
+  // Arguments:
+  //   n_trees: number of trees to add.
+  //   max_time: wall-clock budget in seconds after which no further
+  //     trees are added; at least one tree is trained. Non-positive
+  //     values give no limit.
+  //
+  // Returns: the number of trees added.
+  //
+  // Side-Effects: appends trees to the forest.
+
+  // Observations added since training are only ranked once new trees
+  // need them.
+  if (prefix.n_train != n_train) { prepare_features(); }
+
+  int n_added = grow_trees(next_tree, next_tree + n_trees, max_time,
+                           std::chrono::steady_clock::now(), trees);
+  next_tree += n_added;
+  return n_added;
+}
+
+int Forest::grow_trees(int first, int last, double max_time,
+                       std::chrono::steady_clock::time_point start_time,
+                       std::vector<Tree>& out) {
+  // Trains the trees with indices [first, last).
+  //
+  // Arguments:
+  //   first: index of the first tree.
+  //   last: one past the index of the last tree.
+  //   max_time: wall-clock budget in seconds from start_time after
+  //     which no further trees are trained; at least one tree is
+  //     trained. Non-positive values give no limit.
+  //   start_time: start of the budget.
+  //   out: vector to append the trees to.
+  //
+  // Returns: the number of trees trained.
 
   std::vector<int> weights(n_train, 0);
+  std::vector<int> sample_idx;
+  std::vector<int> sample;
 
-  for (int ii = 0; ii < n_trees; ii++) {
-    draw_weights(weights);
-    trees[ii].train(x_train, z_basis, lens, weights, n_train, n_var, n_basis, mtry,
-                    node_size, min_loss_delta, flambda, fit_oob);
+  bool subsample = sample_fraction > 0.0;
+  int n_sample = 0;
+  if (subsample) {
+    n_sample = std::min(n_train, std::max(1, static_cast<int>(
+      std::round(sample_fraction * n_train))));
+  }
+
+  // Out-of-bag fits need every observation in the tree.
+  if (fit_oob) {
+    sample_idx.resize(n_train);
+    for (int ii = 0; ii < n_train; ii++) { sample_idx[ii] = ii; }
+  }
+
+  size_t n_out = out.size();
+  out.reserve(n_out + last - first);
+  for (int ii = first; ii < last; ii++) {
+    std::seed_seq seq {seed, ii};
+    std::default_random_engine rng(seq);
+
+    if (subsample) {
+      draw_sample(weights, n_sample, sample, rng);
+      if (!fit_oob) { sample_idx = sample; }
+    } else {
+      draw_weights(weights, rng);
+      if (!fit_oob) {
+        // Leave out observations with zero weight to avoid the cost
+        // of sorting/summing over them.
+        sample_idx.clear();
+        for (int jj = 0; jj < n_train; jj++) {
+          if (weights[jj] > 0) { sample_idx.push_back(jj); }
+        }
+      }
+    }
+
+    out.emplace_back();
+    if (pool.empty()) {
+      Partition partition;
+      partition.draw(lens.data(), n_var, flambda, rng);
+      Features features;
+      features.aggregate(x_train, prefix, singles, partition.starts,
+                         partition.ends, n_train, split_mode != RANDOM_SPLIT);
+      out.back().train(partition, features, z_basis, weights, sample_idx,
+                       n_train, n_basis, mtry, node_size, min_loss_delta,
+                       split_mode, n_thresholds, max_depth,
+                       max_leaf_nodes, rng);
+    } else {
+      int kk = ii % pool.size();
+      out.back().train(partitions[kk], pool[kk], z_basis, weights,
+                       sample_idx, n_train, n_basis, mtry, node_size,
+                       min_loss_delta, split_mode, n_thresholds,
+                       max_depth, max_leaf_nodes, rng);
+    }
+
+    if (subsample) {
+      for (auto idx : sample) { weights[idx] = 0; }
+    }
+
+    std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start_time;
+    if (max_time > 0.0 && elapsed.count() >= max_time) { break; }
+  }
+
+  return out.size() - n_out;
+}
+
+#ifdef RFCDE_FORK
+namespace {
+  const int max_shard_attempts = 3;
+
+  struct Shard {
+    int first; // index of the first tree of the shard.
+    int last; // one past the index of the last tree.
+    int attempts; // number of workers launched for the shard.
+    pid_t pid; // worker process; -1 once finished.
+    int fd; // read end of the worker's pipe; -1 once closed.
+    std::string data; // serialized trees received from the worker.
+    std::vector<Tree> trees;
+  };
+
+  bool write_all(int fd, const std::string& data) {
+    size_t offset = 0;
+    while (offset < data.size()) {
+      ssize_t n = write(fd, data.data() + offset, data.size() - offset);
+      if (n < 0 && errno == EINTR) { continue; }
+      if (n <= 0) { return false; }
+      offset += n;
+    }
+    return true;
+  }
+
+  void stop_workers(std::vector<Shard>& shards) {
+    for (auto &shard : shards) {
+      if (shard.fd >= 0) { close(shard.fd); }
+      if (shard.pid > 0) {
+        kill(shard.pid, SIGKILL);
+        waitpid(shard.pid, NULL, 0);
+      }
+    }
   }
 }
+#endif
+
+int Forest::add_trees_forked(int n_trees, double max_time, int n_workers) {
+  // Trains additional trees in forked worker processes.
+  //
+  // The trees are split into contiguous shards, one per worker. Each
+  // worker shares the training data and ranked features with the
+  // parent through copy-on-write pages, grows the trees of its shard
+  // from their (seed, ii) streams and sends them back serialized over
+  // a pipe, so without a time budget the forest is the same as from
+  // add_trees. A shard whose worker crashes is retrained by a new
+  // worker. Trains in-process where fork is unavailable.
+  //
+  // Workers share one deadline, including those retraining a shard.
+  // A worker stopped by it leaves the rest of its shard untrained;
+  // the indices of the whole range are still consumed so that later
+  // trees never reuse their streams.
+  //
+  // Arguments:
+  //   n_trees: number of trees to add.
+  //   max_time: wall-clock budget in seconds shared by the workers;
+  //     each still trains at least one tree. Non-positive values
+  //     give no limit.
+  //   n_workers: number of worker processes.
+  //
+  // Returns: the number of trees added.
+  //
+  // Side-Effects: appends trees to the forest.
+  if (prefix.n_train != n_train) { prepare_features(); }
+
+  n_workers = std::min(n_workers, n_trees);
+#ifndef RFCDE_FORK
+  return add_trees(n_trees, max_time);
+#else
+  if (n_workers <= 1) {
+    return add_trees(n_trees, max_time);
+  }
+  auto start_time = std::chrono::steady_clock::now();
+  int first = next_tree;
+
+  // Rank all features before forking so that workers share them
+  // rather than each ranking its own copy.
+  for (int var = 0; var < n_var; var++) {
+    if (singles[var].empty()) {
+      std::vector<double> values(n_train);
+      x_train.column(var, n_train, values.data());
+      singles[var].build(values.data(), n_train, split_mode != RANDOM_SPLIT);
+    }
+  }
+  for (auto &features : pool) {
+    for (size_t var = 0; var < features.columns.size(); var++) {
+      features.column(var);
+    }
+  }
+
+  std::vector<Shard> shards(n_workers);
+  auto launch = [&](Shard& shard) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+      stop_workers(shards);
+      throw std::runtime_error("Could not create a pipe for a worker");
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+      close(fds[0]);
+      close(fds[1]);
+      stop_workers(shards);
+      throw std::runtime_error("Could not fork a worker");
+    }
+    if (pid == 0) {
+      close(fds[0]);
+      int status = 1;
+      try {
+        std::vector<Tree> out;
+        grow_trees(shard.first, shard.last, max_time, start_time, out);
+        std::ostringstream stream;
+        save_trees(stream, out);
+        if (write_all(fds[1], stream.str())) { status = 0; }
+      } catch (...) {}
+      _exit(status);
+    }
+    close(fds[1]);
+    shard.pid = pid;
+    shard.fd = fds[0];
+    shard.data.clear();
+    shard.attempts++;
+  };
+
+  for (int ww = 0; ww < n_workers; ww++) {
+    shards[ww].first = first + static_cast<long>(n_trees) * ww / n_workers;
+    shards[ww].last = first + static_cast<long>(n_trees) * (ww + 1) / n_workers;
+    shards[ww].attempts = 0;
+    shards[ww].pid = -1;
+    shards[ww].fd = -1;
+  }
+  for (auto &shard : shards) { launch(shard); }
+
+  // Drain the pipes concurrently so that no worker blocks on a full
+  // pipe; a shard is done when its pipe closes and its worker exited
+  // cleanly with trees that deserialize.
+  std::vector<char> buffer(1 << 16);
+  int n_running = n_workers;
+  while (n_running > 0) {
+    std::vector<pollfd> fds;
+    std::vector<Shard*> polled;
+    for (auto &shard : shards) {
+      if (shard.fd < 0) { continue; }
+      pollfd entry = {shard.fd, POLLIN, 0};
+      fds.push_back(entry);
+      polled.push_back(&shard);
+    }
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR) { continue; }
+      stop_workers(shards);
+      throw std::runtime_error("Could not poll workers");
+    }
+
+    for (size_t kk = 0; kk < fds.size(); kk++) {
+      if (fds[kk].revents == 0) { continue; }
+      Shard& shard = *polled[kk];
+      ssize_t n = read(shard.fd, buffer.data(), buffer.size());
+      if (n > 0) {
+        shard.data.append(buffer.data(), n);
+        continue;
+      }
+      if (n < 0 && errno == EINTR) { continue; }
+
+      close(shard.fd);
+      shard.fd = -1;
+      int status = 0;
+      waitpid(shard.pid, &status, 0);
+      shard.pid = -1;
+
+      bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+      if (ok) {
+        try {
+          std::istringstream stream(shard.data);
+          load_trees(stream, shard.trees, *this);
+        } catch (...) {
+          ok = false;
+        }
+      }
+      std::string().swap(shard.data);
+
+      if (ok) {
+        n_running--;
+      } else if (shard.attempts < max_shard_attempts) {
+        launch(shard);
+      } else {
+        stop_workers(shards);
+        throw std::runtime_error("Worker failed to train trees " +
+                                 std::to_string(shard.first) + " to " +
+                                 std::to_string(shard.last - 1));
+      }
+    }
+  }
+
+  size_t n_old = trees.size();
+  trees.reserve(n_old + n_trees);
+  for (auto &shard : shards) {
+    for (auto &tree : shard.trees) {
+      trees.push_back(std::move(tree));
+    }
+  }
+  next_tree = first + n_trees;
+  return trees.size() - n_old;
+#endif
+}
+
+void Forest::add_observations(const MatrixView& x_train,
+                              const MatrixView& z_basis, int n_train) {
+  // Adds new observations to the leaves of the trained trees.
+  //
+  // Each new observation is routed through every tree and kept by
+  // the leaf containing it with a fresh bootstrap weight; the tree
+  // structure is unchanged so the cost is linear in the number of
+  // new observations. Weights for tree ii are drawn from a stream
+  // seeded by (seed, ii, previous number of observations).
+  //
+  // Arguments:
+  //   x_train: view of the covariates of the previous and new
+  //     observations; replaces the training covariates kept for
+  //     add_trees.
+  //   z_basis: view of the basis function evaluations of the
+  //     previous and new observations (column-major).
+  //   n_train: number of observations including the new ones; the
+  //     new observations are the last n_train - this -> n_train rows,
+  //     of which there must be at least one.
+  //
+  // Side-Effects: appends the new observations to leaf nodes and
+  //   updates their basis sums.
+  int n_old = this -> n_train;
+  if (n_train <= n_old) {
+    throw std::invalid_argument("No new observations to add");
+  }
+  check_basis(z_basis, n_train);
+  int n_new = n_train - n_old;
+
+  this -> x_train = x_train;
+  this -> z_basis = z_basis;
+  this -> n_train = n_train;
+  this -> fingerprint = update_fingerprint(fingerprint, x_train, z_basis,
+                                           n_train, n_var, n_basis, n_old);
+
+  // Rows and prefix sums of the new observations are shared by all
+  // trees.
+  std::vector<double> rows(static_cast<size_t>(n_new) * n_var);
+  std::vector<double> prefixes(static_cast<size_t>(n_new) * prefix.n_cols);
+  std::vector<double> row;
+  for (int ii = 0; ii < n_new; ii++) {
+    x_train.row(n_old + ii, n_var, &rows[ii * n_var]);
+    prefix.row(&rows[ii * n_var], row);
+    std::copy(row.begin(), row.end(), prefixes.begin() + ii * prefix.n_cols);
+  }
+
+  std::poisson_distribution<int> rpois(1.0);
+  std::bernoulli_distribution rbern(std::max(0.0, sample_fraction));
+  for (int tt = 0; tt < static_cast<int>(trees.size()); tt++) {
+    std::seed_seq seq {seed, tt, n_old};
+    std::default_random_engine rng(seq);
 
-void draw_weights(std::vector<int>& weights) {
+    trees[tt].n_train = n_train;
+    for (int ii = 0; ii < n_new; ii++) {
+      int weight = sample_fraction > 0.0 ? rbern(rng) : rpois(rng);
+      // Out-of-bag fits need every observation in the tree.
+      if (weight == 0 && !fit_oob) { continue; }
+      trees[tt].add_observation(&rows[ii * n_var],
+                                prefixes.data() + ii * prefix.n_cols,
+                                z_basis, n_basis, n_old + ii,
+                                weight);
+    }
+  }
+}
+
+void Forest::merge(Forest& other) {
+  // Moves the trees of another forest trained on the same data into
+  // this forest.
+  //
+  // Trees refer to training observations by index so both forests
+  // must have been trained on the same rows of x_train and z_basis,
+  // checked through their fingerprints, with the same functional
+  // variables and out-of-bag setting. Their seeds must differ, since
+  // trees grown from the same seed and index are identical.
+  //
+  // Arguments:
+  //   other: forest to merge; its trees are moved.
+  //
+  // Side-Effects: appends the trees of other to trees and empties
+  //   other.trees.
+  if (&other == this) {
+    throw std::invalid_argument("Cannot merge a forest with itself");
+  }
+  if (other.n_train != n_train || other.n_var != n_var ||
+      other.n_basis != n_basis || other.lens != lens ||
+      other.fingerprint != fingerprint) {
+    throw std::invalid_argument("Forests were trained on different data");
+  }
+  if (other.fit_oob != fit_oob) {
+    throw std::invalid_argument("Forests differ in fitting out-of-bag samples");
+  }
+  if (other.seed == seed) {
+    throw std::invalid_argument("Forests were trained with the same seed");
+  }
+
+  trees.reserve(trees.size() + other.trees.size());
+  for (auto &tree : other.trees) {
+    trees.push_back(std::move(tree));
+  }
+  other.trees.clear();
+}
+
+void Forest::save(std::ostream& out) const {
+  // Writes the trees and the metadata needed for prediction and
+  // merging in binary form; the training data is not included.
+  //
+  // Arguments:
+  //   out: stream to write to.
+  out.write(magic, sizeof(magic));
+  write_value(out, format_version);
+  write_value(out, n_train);
+  write_value(out, n_var);
+  write_value(out, n_basis);
+  write_value(out, fit_oob);
+  write_value(out, seed);
+  write_value(out, next_tree);
+  write_value(out, fingerprint);
+  write_vector(out, lens);
+  write_vector(out, prefix.before);
+  write_value(out, prefix.n_cols);
+  save_trees(out, trees);
+}
+
+void Forest::load(std::istream& in) {
+  // Reads a forest written by save.
+  //
+  // The loaded forest can predict and be merged but holds no
+  // training data, so trees or observations cannot be added.
+  //
+  // Arguments:
+  //   in: stream to read from.
+  //
+  // Side-Effects: replaces the trees and metadata of the forest.
+  char header[sizeof(magic)];
+  in.read(header, sizeof(magic));
+  if (!in || !std::equal(header, header + sizeof(magic), magic)) {
+    throw std::invalid_argument("Not a serialized forest");
+  }
+  uint32_t version;
+  read_value(in, version);
+  // Version 1 predates next_tree.
+  if (version != format_version && version != 1) {
+    throw std::invalid_argument("Unsupported serialized forest version");
+  }
+
+  read_value(in, n_train);
+  read_value(in, n_var);
+  read_value(in, n_basis);
+  read_value(in, fit_oob);
+  read_value(in, seed);
+  next_tree = -1;
+  if (version > 1) { read_value(in, next_tree); }
+  read_value(in, fingerprint);
+  read_vector(in, lens);
+  prefix = PrefixSums();
+  read_vector(in, prefix.before);
+  read_value(in, prefix.n_cols);
+  if (n_train < 0 || n_var < 0 || n_basis < 0 ||
+      prefix.before.size() != static_cast<size_t>(n_var) ||
+      prefix.n_cols < 0 || prefix.n_cols > 2 * n_var) {
+    throw std::invalid_argument("Corrupt serialized forest");
+  }
+  for (auto &lo : prefix.before) {
+    if (lo < -1 || (lo >= 0 && lo + 1 >= prefix.n_cols)) {
+      throw std::invalid_argument("Corrupt serialized forest");
+    }
+  }
+  load_trees(in, trees, *this);
+  if (next_tree < 0) { next_tree = trees.size(); }
+
+  x_train = MatrixView();
+  z_basis = MatrixView();
+  singles.clear();
+  partitions.clear();
+  pool.clear();
+}
+
+void Forest::fill_series_coefs(const double* x_test, double* coefs) const {
+  // Calculates basis coefficients of the series density estimate.
+  //
+  // The coefficients are the weighted mean basis evaluations of the
+  // training responses using the forest weights, obtained from the
+  // sums kept by each leaf without visiting training responses.
+  //
+  // Arguments:
+  //   x_test: pointer to a new observation.
+  //   coefs: pointer to a buffer of length n_basis.
+  //
+  // Side-Effects: fills coefs with the basis coefficients.
+  std::vector<int> leaf_row(trees.size());
+  fill_leaf_ids(x_test, leaf_row.data());
+  fill_leaf_series_coefs(leaf_row.data(), coefs);
+}
+
+void Forest::predict_series_cde(const double* x_test,
+                                const double* grid_basis, int n_grid,
+                                double* cde) const {
+  // Evaluates the series density estimate on a grid.
+  //
+  // Arguments:
+  //   x_test: pointer to a new observation.
+  //   grid_basis: pointer to basis evaluations at the grid points
+  //     (column-major, n_grid x n_basis).
+  //   n_grid: number of grid points.
+  //   cde: pointer to a buffer of length n_grid.
+  //
+  // Side-Effects: fills cde with the density estimate at each grid
+  //   point.
+  std::vector<int> leaf_row(trees.size());
+  fill_leaf_ids(x_test, leaf_row.data());
+  predict_leaf_series_cde(leaf_row.data(), grid_basis, n_grid, cde);
+}
+
+void Forest::fill_leaf_ids(const double* x_test, int* leaf_row) const {
+  // Finds the leaf of each tree containing a new observation.
+  //
+  // Arguments:
+  //   x_test: pointer to a new observation.
+  //   leaf_row: pointer to a buffer of length n_trees().
+  //
+  // Side-Effects: fills leaf_row with the leaf_id for each tree.
+  std::vector<double> row;
+  prefix.row(x_test, row);
+  for (size_t tt = 0; tt < trees.size(); tt++) {
+    leaf_row[tt] = trees[tt].traverse(x_test, row.data()) -> leaf_id;
+  }
+}
+
+void Forest::apply(const MatrixView& x_test, int n_test, int* leaf_ids,
+                   int n_threads, const BitvectorScorer* scorer) const {
+  // Finds the leaf of each tree containing each new observation.
+  //
+  // Rows are split into contiguous blocks routed by separate threads;
+  // the trees are only read so they are shared between threads.
+  //
+  // Arguments:
+  //   x_test: view of the new observations.
+  //   n_test: number of new observations.
+  //   leaf_ids: pointer to a buffer of n_test rows of n_trees() leaf
+  //     ids (row-major).
+  //   n_threads: number of threads; non-positive values use the
+  //     hardware concurrency.
+  //   scorer: (optional) bitvector scorer built from this forest;
+  //     groups of rows are traversed in lockstep when NULL.
+  //
+  // Side-Effects: fills leaf_ids.
+  if (n_threads <= 0) {
+    n_threads = std::thread::hardware_concurrency();
+  }
+  n_threads = std::max(1, std::min(n_threads, n_test));
+
+  auto route = [&](int first, int last) {
+    if (scorer != NULL) {
+      scorer -> apply(x_test, first, last, leaf_ids);
+      return;
+    }
+    apply_lockstep(x_test, first, last, leaf_ids);
+  };
+
+  std::vector<std::thread> threads;
+  for (int kk = 1; kk < n_threads; kk++) {
+    threads.emplace_back(route, static_cast<int64_t>(n_test) * kk / n_threads,
+                         static_cast<int64_t>(n_test) * (kk + 1) / n_threads);
+  }
+  route(0, n_test / n_threads);
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+void Forest::apply_lockstep(const MatrixView& x_test, int first, int last,
+                            int* leaf_ids) const {
+  // Finds the leaves of a range of rows, walking groups of
+  // lockstep_rows rows through each tree together.
+  //
+  // Each group transposes its covariates, prefix sums and a column
+  // of zeros once. Trees with a block for every covariate read the
+  // covariates directly; other trees read each block as the
+  // difference of two columns at the nodes the rows visit.
+  //
+  // Arguments:
+  //   x_test: view of the new observations.
+  //   first: first row to route.
+  //   last: one past the last row to route.
+  //   leaf_ids: pointer to a buffer of rows of n_trees() leaf ids
+  //     (row-major) starting at row 0 of x_test.
+  //
+  // Side-Effects: fills rows [first, last) of leaf_ids.
+  size_t n_cols = trees.size();
+  int zero_col = n_var + prefix.n_cols;
+  std::vector<bool> singletons(n_cols);
+  std::vector<std::vector<int> > hi(n_cols);
+  std::vector<std::vector<int> > lo(n_cols);
+  for (size_t tt = 0; tt < n_cols; tt++) {
+    const Tree& tree = trees[tt];
+    singletons[tt] = static_cast<int>(tree.starts.size()) == n_var;
+    for (size_t var = 0; var < tree.starts.size(); var++) {
+      int lo_var = tree.prefix_lo[var];
+      if (lo_var >= 0 || tree.starts[var] != static_cast<int>(var)) {
+        singletons[tt] = false;
+      }
+      // Matches Tree::calculate_feature; singletons subtract zero.
+      if (lo_var < 0) {
+        hi[tt].push_back(tree.starts[var]);
+        lo[tt].push_back(zero_col);
+      } else {
+        hi[tt].push_back(n_var + lo_var + tree.ends[var] - tree.starts[var]);
+        lo[tt].push_back(n_var + lo_var);
+      }
+    }
+  }
+
+  std::vector<double> row(n_var);
+  std::vector<double> row_prefix;
+  std::vector<double> columns((zero_col + 1) * lockstep_rows, 0.0);
+  int group[lockstep_rows];
+  for (int block = first; block < last; block += lockstep_rows) {
+    // Partial groups repeat their last row.
+    int n_rows = std::min(lockstep_rows, last - block);
+    for (int rr = 0; rr < lockstep_rows; rr++) {
+      x_test.row(block + std::min(rr, n_rows - 1), n_var, row.data());
+      prefix.row(row.data(), row_prefix);
+      for (int var = 0; var < n_var; var++) {
+        columns[var * lockstep_rows + rr] = row[var];
+      }
+      for (int col = 0; col < prefix.n_cols; col++) {
+        columns[(n_var + col) * lockstep_rows + rr] = row_prefix[col];
+      }
+    }
+
+    for (size_t tt = 0; tt < n_cols; tt++) {
+      if (singletons[tt]) {
+        traverse_lockstep(trees[tt], columns.data(), group);
+      } else {
+        traverse_lockstep_blocks(trees[tt], columns.data(), hi[tt].data(),
+                                 lo[tt].data(), group);
+      }
+      for (int rr = 0; rr < n_rows; rr++) {
+        leaf_ids[(block + rr) * n_cols + tt] = group[rr];
+      }
+    }
+  }
+}
+
+bool Forest::valid_leaf_ids(const int* leaf_ids, int n_rows) const {
+  // Whether every entry of rows of leaf ids (row-major, n_rows x
+  // n_trees()) is a leaf of its tree.
+  size_t n_cols = trees.size();
+  for (size_t ii = 0; ii < n_rows * n_cols; ii++) {
+    int id = leaf_ids[ii];
+    if (id < 0 || id >= trees[ii % n_cols].n_leaves()) { return false; }
+  }
+  return true;
+}
+
+void Forest::fill_leaf_series_coefs(const int* leaf_row, double* coefs) const {
+  // Calculates basis coefficients of the series density estimate from
+  // the leaf of each tree; see fill_series_coefs.
+  //
+  // Arguments:
+  //   leaf_row: pointer to the leaf_id for each tree.
+  //   coefs: pointer to a buffer of length n_basis.
+  //
+  // Side-Effects: fills coefs with the basis coefficients.
+  double weight = 0.0;
+  std::fill(coefs, coefs + n_basis, 0.0);
+  for (size_t tt = 0; tt < trees.size(); tt++) {
+    trees[tt].update_leaf_series(trees[tt].leaf(leaf_row[tt]), coefs, weight);
+  }
+
+  if (weight > 0.0) {
+    for (int bb = 0; bb < n_basis; bb++) { coefs[bb] /= weight; }
+  }
+}
+
+void Forest::predict_leaf_series_cde(const int* leaf_row,
+                                     const double* grid_basis, int n_grid,
+                                     double* cde) const {
+  // Evaluates the series density estimate on a grid from the leaf of
+  // each tree; see predict_series_cde.
+  std::vector<double> coefs(n_basis);
+  fill_leaf_series_coefs(leaf_row, coefs.data());
+
+  std::fill(cde, cde + n_grid, 0.0);
+  for (int bb = 0; bb < n_basis; bb++) {
+    for (int gg = 0; gg < n_grid; gg++) {
+      cde[gg] += grid_basis[bb * n_grid + gg] * coefs[bb];
+    }
+  }
+}
+
+void draw_weights(std::vector<int>& weights,
+                  std::default_random_engine& rng) {
   // Draw bootstrap weights using Pois(1) random variables.
   //
   // This is an approximation to the Multinomial bootstrap weights.
   //
   // Arguments:
   //   weights: a vector of weights to fill
+  //   rng: random engine.
   //
   // Side-Effects: fills weights with draws from a Pois(1) RV.
+  std::poisson_distribution<int> distribution(1.0);
 
-  static std::default_random_engine generator;
-  static std::poisson_distribution<int> distribution(1.0);
+  for (size_t ii = 0; ii < weights.size(); ii++) {
+    weights[ii] = distribution(rng);
+  }
+}
 
-  for (int ii = 0; ii < weights.size(); ii++) {
-    weights[ii] = distribution(generator);
+void draw_sample(std::vector<int>& weights, int n_sample,
+                 std::vector<int>& sample, std::default_random_engine& rng) {
+  // Draw a sample without replacement using Floyd's algorithm.
+  //
+  // The cost is O(n_sample) and the sample only depends on rng.
+  //
+  // Arguments:
+  //   weights: a vector of zero weights; used to mark the sample.
+  //   n_sample: number of observations to sample.
+  //   sample: vector to fill with the sampled indices.
+  //   rng: random engine.
+  //
+  // Side-Effects: fills sample and sets the weights of the sampled
+  //   observations to 1.
+  int n_train = weights.size();
+  sample.clear();
+  for (int jj = n_train - n_sample; jj < n_train; jj++) {
+    std::uniform_int_distribution<int> distribution(0, jj);
+    int idx = distribution(rng);
+    if (weights[idx] != 0) { idx = jj; }
+    weights[idx] = 1;
+    sample.push_back(idx);
   }
 }
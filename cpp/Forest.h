@@ -3,46 +3,170 @@
 
 #ifndef FOREST_GUARD
 #define FOREST_GUARD
+#include <stdint.h>
+#include <chrono>
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <string>
 #include "Tree.h"
+#include "Matrix.h"
+#include "Scorer.h"
 
 class Forest {
  public:
   std::vector<Tree> trees; // vector of trees in the forest
   bool fit_oob;
+  int n_basis;
+  PrefixSums prefix; // functional prefix sums.
 
-  void train(double* x_train, double* z_basis, int* lens,
+  // Training data and parameters kept by train for add_trees; the
+  // caller must keep x_train and z_basis alive while adding trees or
+  // observations.
+  MatrixView x_train;
+  MatrixView z_basis; // column-major.
+  std::vector<int> lens;
+  int n_train;
+  int n_var;
+  int mtry;
+  int node_size;
+  double min_loss_delta;
+  double flambda;
+  int split_mode;
+  int n_thresholds;
+  double sample_fraction;
+  int max_depth;
+  int max_leaf_nodes;
+  int seed;
+  int next_tree; // index of the random stream of the next tree grown.
+  uint64_t fingerprint; // hash of the rows of x_train and z_basis.
+
+  // Ranked features shared by the trees; Features refer to the
+  // other members so the forest must not be moved after training.
+  std::vector<RankedColumn> singles;
+  std::vector<Partition> partitions;
+  std::vector<Features> pool;
+
+  void train(const MatrixView& x_train, const MatrixView& z_basis, int* lens,
              int n_train, int n_var, int n_basis, int n_trees, int mtry,
-             int node_size, double min_loss_delta, double flambda, bool fit_oob);
+             int node_size, double min_loss_delta, double flambda, bool fit_oob,
+             int split_mode, int n_thresholds, double sample_fraction,
+             int n_partitions, int max_depth, int max_leaf_nodes,
+             double max_time, int seed, int n_workers);
+
+  int add_trees(int n_trees, double max_time);
+  int add_trees_forked(int n_trees, double max_time, int n_workers);
+  int grow_trees(int first, int last, double max_time,
+                 std::chrono::steady_clock::time_point start_time,
+                 std::vector<Tree>& out);
+  void add_observations(const MatrixView& x_train, const MatrixView& z_basis,
+                        int n_train);
+  void prepare_features();
+  void merge(Forest& other);
+  void save(std::ostream& out) const;
+  void load(std::istream& in);
+
+  // String forms of save/load for the bindings.
+  std::string serialize() const {
+    std::ostringstream out;
+    save(out);
+    return out.str();
+  }
+
+  void deserialize(const std::string& data) {
+    std::istringstream in(data);
+    load(in);
+  }
+
+  int n_trees() const {
+    return trees.size();
+  }
 
-  // Python uses longs for their integers; use template for easy
-  // wrapping.
+  // Prediction methods are const and keep their scratch space local,
+  // so any number of threads may predict from a trained forest at
+  // once as long as none of them trains or modifies it.
+
+  int64_t max_weight() const {
+    // Bound on any entry of fill_weights or fill_oob_weights; buffers
+    // of narrow integer types are safe when it fits.
+    int64_t total = 0;
+    for (const auto &tree : trees) {
+      total += tree.max_weight();
+    }
+    return total;
+  };
+
+  // Python uses uint16, uint32 or longs and R uses ints for their
+  // weights; use template for easy wrapping.
   template<class INTEGER>
-  void fill_weights(double* x_test, INTEGER* wt_buf) {
-    for (auto &tree : trees) {
-      tree.update_weights(x_test, wt_buf);
+  void fill_weights(const double* x_test, INTEGER* wt_buf) const {
+    // Prefix sums of the observation are shared by all trees.
+    std::vector<double> row;
+    prefix.row(x_test, row);
+    for (const auto &tree : trees) {
+      tree.update_weights(x_test, row.data(), wt_buf);
     }
   };
 
+  template<class REAL>
+  void fill_normalized_weights(const double* x_test, REAL* wt_buf) const {
+    // Fills a zeroed buffer with weights scaled to sum to one; all
+    // zeros if no training point shares a leaf with x_test.
+    fill_weights(x_test, wt_buf);
+    double total = 0.0;
+    for (int ii = 0; ii < n_train; ii++) { total += wt_buf[ii]; }
+    if (total <= 0.0) { return; }
+    for (int ii = 0; ii < n_train; ii++) { wt_buf[ii] /= total; }
+  };
+
   template<class INTEGER>
-  void fill_oob_weights(INTEGER* wt_mat) {
-    for (auto &tree : trees) {
+  void fill_oob_weights(INTEGER* wt_mat) const {
+    for (const auto &tree : trees) {
       tree.update_oob_weights(wt_mat);
     }
   };
 
-  void fill_loss_importance(double* scores) {
-    for (auto &tree : trees) {
+  void fill_series_coefs(const double* x_test, double* coefs) const;
+
+  void predict_series_cde(const double* x_test, const double* grid_basis,
+                          int n_grid, double* cde) const;
+
+  // Leaf ids of each tree for new observations; the methods below
+  // predict from rows of leaf ids without traversing the trees.
+  void fill_leaf_ids(const double* x_test, int* leaf_row) const;
+  void apply(const MatrixView& x_test, int n_test, int* leaf_ids,
+             int n_threads, const BitvectorScorer* scorer = NULL) const;
+  void apply_lockstep(const MatrixView& x_test, int first, int last,
+                      int* leaf_ids) const;
+  bool valid_leaf_ids(const int* leaf_ids, int n_rows) const;
+
+  template<class INTEGER>
+  void fill_leaf_weights(const int* leaf_row, INTEGER* wt_buf) const {
+    for (size_t tt = 0; tt < trees.size(); tt++) {
+      trees[tt].update_leaf_weights(trees[tt].leaf(leaf_row[tt]), wt_buf);
+    }
+  };
+
+  void fill_leaf_series_coefs(const int* leaf_row, double* coefs) const;
+
+  void predict_leaf_series_cde(const int* leaf_row, const double* grid_basis,
+                               int n_grid, double* cde) const;
+
+  void fill_loss_importance(double* scores) const {
+    for (const auto &tree : trees) {
       tree.update_loss_importance(scores);
     }
   };
 
-  void fill_count_importance(double* scores) {
-    for (auto &tree : trees) {
+  void fill_count_importance(double* scores) const {
+    for (const auto &tree : trees) {
       tree.update_count_importance(scores);
     }
   };
 };
 
-void draw_weights(std::vector<int>& weights);
+void draw_weights(std::vector<int>& weights, std::default_random_engine& rng);
+void draw_sample(std::vector<int>& weights, int n_sample,
+                 std::vector<int>& sample, std::default_random_engine& rng);
 
 #endif
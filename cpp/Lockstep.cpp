@@ -0,0 +1,148 @@
+// Copyright Taylor Pospisil 2018.
+// Distributed under MIT License (http://opensource.org/licenses/MIT)
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#include "Lockstep.h"
+
+namespace {
+#if defined(__AVX2__)
+  // The vector walk holds one row per 32-bit lane of a 256-bit
+  // register, and column_lanes multiplies by lockstep_rows as a shift.
+  static_assert(lockstep_rows == 8, "lockstep_rows must be 8 for AVX2");
+
+  inline __m256i column_lanes(__m256i column) {
+    // Offsets of element [column * lockstep_rows + row] of each row.
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    return _mm256_add_epi32(_mm256_slli_epi32(column, 3), lanes);
+  }
+#endif
+
+  template<bool BLOCKS>
+  void walk(const Tree& tree, const double* columns, const int* hi,
+            const int* lo, int* leaf_ids) {
+    // Walks lockstep_rows rows through a tree one level at a time.
+    //
+    // Without BLOCKS feature var of a row is column var; with BLOCKS
+    // it is column hi[var] minus column lo[var], gathered only for
+    // the nodes the rows visit.
+    if (tree.flat_var.empty()) {
+      for (int rr = 0; rr < lockstep_rows; rr++) { leaf_ids[rr] = 0; }
+      return;
+    }
+
+#if defined(__AVX2__)
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256i node = zero;
+    while (true) {
+      // Leaves are negative so the sign bits mark finished rows.
+      __m256i active = _mm256_cmpgt_epi32(node, _mm256_set1_epi32(-1));
+      if (_mm256_testz_si256(active, active)) { break; }
+      __m256i safe = _mm256_max_epi32(node, zero);
+
+      __m256i var = _mm256_i32gather_epi32(tree.flat_var.data(), safe, 4);
+      __m256i upper = column_lanes(
+        BLOCKS ? _mm256_i32gather_epi32(hi, var, 4) : var);
+#if defined(__AVX512F__)
+      __m512d value = _mm512_i32gather_pd(upper, columns, 8);
+      if (BLOCKS) {
+        __m256i lower = column_lanes(_mm256_i32gather_epi32(lo, var, 4));
+        value = _mm512_sub_pd(value, _mm512_i32gather_pd(lower, columns, 8));
+      }
+      int le_bits = _mm512_cmp_pd_mask(
+        value, _mm512_i32gather_pd(safe, tree.flat_value.data(), 8),
+        _CMP_LE_OQ);
+#else
+      __m256d value_lo = _mm256_i32gather_pd(
+        columns, _mm256_castsi256_si128(upper), 8);
+      __m256d value_hi = _mm256_i32gather_pd(
+        columns, _mm256_extracti128_si256(upper, 1), 8);
+      if (BLOCKS) {
+        __m256i lower = column_lanes(_mm256_i32gather_epi32(lo, var, 4));
+        value_lo = _mm256_sub_pd(value_lo, _mm256_i32gather_pd(
+          columns, _mm256_castsi256_si128(lower), 8));
+        value_hi = _mm256_sub_pd(value_hi, _mm256_i32gather_pd(
+          columns, _mm256_extracti128_si256(lower, 1), 8));
+      }
+      __m256d le_lo = _mm256_cmp_pd(value_lo, _mm256_i32gather_pd(
+        tree.flat_value.data(), _mm256_castsi256_si128(safe), 8), _CMP_LE_OQ);
+      __m256d le_hi = _mm256_cmp_pd(value_hi, _mm256_i32gather_pd(
+        tree.flat_value.data(), _mm256_extracti128_si256(safe, 1), 8),
+        _CMP_LE_OQ);
+      int le_bits = _mm256_movemask_pd(le_lo) | (_mm256_movemask_pd(le_hi) << 4);
+#endif
+      __m256i le = _mm256_cmpeq_epi32(
+        _mm256_and_si256(_mm256_set1_epi32(le_bits), lane_bits), lane_bits);
+
+      __m256i next = _mm256_blendv_epi8(
+        _mm256_i32gather_epi32(tree.flat_gt.data(), safe, 4),
+        _mm256_i32gather_epi32(tree.flat_le.data(), safe, 4), le);
+      node = _mm256_blendv_epi8(node, next, active);
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(leaf_ids),
+                        _mm256_xor_si256(node, _mm256_set1_epi32(-1)));
+#else
+    int node[lockstep_rows] = {0};
+    for (bool active = true; active; ) {
+      active = false;
+      for (int rr = 0; rr < lockstep_rows; rr++) {
+        int cur = node[rr];
+        if (cur < 0) { continue; }
+        int var = tree.flat_var[cur];
+        // NaN features go to the > child, as in Tree::traverse.
+        double value = BLOCKS ?
+          columns[hi[var] * lockstep_rows + rr] -
+          columns[lo[var] * lockstep_rows + rr] :
+          columns[var * lockstep_rows + rr];
+        node[rr] = (value <= tree.flat_value[cur]) ?
+          tree.flat_le[cur] : tree.flat_gt[cur];
+        active = true;
+      }
+    }
+    for (int rr = 0; rr < lockstep_rows; rr++) { leaf_ids[rr] = ~node[rr]; }
+#endif
+  }
+}
+
+void traverse_lockstep(const Tree& tree, const double* features,
+                       int* leaf_ids) {
+  // Walks lockstep_rows rows through a tree one level at a time.
+  //
+  // The rows share the loads of each level so the top of the tree
+  // stays in cache. With AVX2 (and AVX-512 for the comparisons) the
+  // split variables, thresholds and children of all rows are
+  // gathered from the flat node arrays at once; otherwise rows step
+  // through the same loop one at a time. Rows that have reached a
+  // leaf keep their leaf while the others continue.
+  //
+  // Arguments:
+  //   tree: tree with flat node arrays from index_leaves.
+  //   features: the tree's features of each row; element
+  //     [var * lockstep_rows + row] is feature var of row.
+  //   leaf_ids: pointer to a buffer of length lockstep_rows.
+  //
+  // Side-Effects: fills leaf_ids with the leaf_id of each row.
+  walk<false>(tree, features, NULL, NULL, leaf_ids);
+}
+
+void traverse_lockstep_blocks(const Tree& tree, const double* columns,
+                              const int* hi, const int* lo,
+                              int* leaf_ids) {
+  // Walks lockstep_rows rows through a tree whose features are
+  // differences of columns, as traverse_lockstep.
+  //
+  // Features are computed at the nodes the rows visit, so the cost
+  // follows the depth of the walk rather than the number of blocks.
+  //
+  // Arguments:
+  //   tree: tree with flat node arrays from index_leaves.
+  //   columns: columns of each row; element [col * lockstep_rows +
+  //     row] is column col of row.
+  //   hi, lo: columns whose difference is each feature of the tree.
+  //   leaf_ids: pointer to a buffer of length lockstep_rows.
+  //
+  // Side-Effects: fills leaf_ids with the leaf_id of each row.
+  walk<true>(tree, columns, hi, lo, leaf_ids);
+}
@@ -0,0 +1,18 @@
+// Copyright Taylor Pospisil 2018.
+// Distributed under MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef LOCKSTEP_GUARD
+#define LOCKSTEP_GUARD
+#include "Tree.h"
+
+// Rows walked through a tree together; one AVX-512 register or two
+// AVX2 registers of doubles.
+const int lockstep_rows = 8;
+
+void traverse_lockstep(const Tree& tree, const double* features,
+                       int* leaf_ids);
+void traverse_lockstep_blocks(const Tree& tree, const double* columns,
+                              const int* hi, const int* lo,
+                              int* leaf_ids);
+
+#endif
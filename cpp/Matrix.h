@@ -0,0 +1,78 @@
+// Copyright Taylor Pospisil 2018.
+// Distributed under MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef MATRIX_GUARD
+#define MATRIX_GUARD
+#include <cstddef>
+
+// Element types of matrix views.
+enum DataType { FLOAT64 = 0, FLOAT32 = 1 };
+
+class MatrixView {
+ public:
+  // Read-only view of a strided matrix owned by the caller; element
+  // [ii, jj] is data[ii * row_stride + jj * col_stride] so both row-
+  // and column-major layouts are viewed without copying. Matrices
+  // stored as separate column buffers set columns instead, with
+  // element [ii, jj] at columns[jj][ii * row_stride].
+  const void* data;
+  const void* const* columns; // NULL unless stored by column buffers.
+  ptrdiff_t row_stride; // in elements.
+  ptrdiff_t col_stride; // in elements.
+  int dtype; // a DataType.
+
+  MatrixView() : data(NULL), columns(NULL), row_stride(0), col_stride(0),
+                 dtype(FLOAT64) {}
+
+  MatrixView(const void* data, ptrdiff_t row_stride, ptrdiff_t col_stride,
+             int dtype) : data(data), columns(NULL), row_stride(row_stride),
+                          col_stride(col_stride), dtype(dtype) {}
+
+  static MatrixView column_major(const double* data, int n_rows) {
+    return MatrixView(data, 1, n_rows, FLOAT64);
+  }
+
+  static MatrixView column_major(const float* data, int n_rows) {
+    return MatrixView(data, 1, n_rows, FLOAT32);
+  }
+
+  static MatrixView column_buffers(const void* const* columns, int dtype) {
+    MatrixView view(NULL, 1, 0, dtype);
+    view.columns = columns;
+    return view;
+  }
+
+  void column(int col, int n_rows, double* out) const {
+    // Copies a column into out, converting to double.
+    if (dtype == FLOAT32) {
+      gather(column_data<float>(col), row_stride, n_rows, out);
+    } else {
+      gather(column_data<double>(col), row_stride, n_rows, out);
+    }
+  }
+
+  void row(int row, int n_cols, double* out) const {
+    // Copies a row into out, converting to double.
+    for (int jj = 0; jj < n_cols; jj++) {
+      if (dtype == FLOAT32) {
+        out[jj] = column_data<float>(jj)[row * row_stride];
+      } else {
+        out[jj] = column_data<double>(jj)[row * row_stride];
+      }
+    }
+  }
+
+ private:
+  template<class T>
+  const T* column_data(int col) const {
+    if (columns != NULL) { return static_cast<const T*>(columns[col]); }
+    return static_cast<const T*>(data) + col * col_stride;
+  }
+
+  template<class T>
+  static void gather(const T* src, ptrdiff_t stride, int n, double* out) {
+    for (int ii = 0; ii < n; ii++) { out[ii] = src[ii * stride]; }
+  }
+};
+
+#endif
@@ -3,8 +3,10 @@
 
 #include <vector>
 #include <random>
+#include <stdexcept>
 #include "Node.h"
 #include "helpers.h"
+#include "Serialize.h"
 
 typedef std::vector<int>::iterator ivecit;
 
@@ -12,8 +14,12 @@ Node::Node() {
   split_value = 0.0;
   loss_delta = 0.0;
   split_var = -1;
+  weight = 0;
   le_child = NULL;
   gt_child = NULL;
+  valid_idx_begin = 0;
+  valid_idx_end = 0;
+  leaf_id = -1;
 }
 
 Node::~Node() {
@@ -21,25 +27,60 @@ Node::~Node() {
   if (gt_child) delete gt_child;
 }
 
-void Node::train(double* x_train, double* z_basis,
+Node::Node(Node&& other) noexcept : Node() {
+  *this = std::move(other);
+}
+
+Node& Node::operator=(Node&& other) noexcept {
+  // Takes ownership of the children of other.
+  if (this == &other) { return *this; }
+  if (le_child) delete le_child;
+  if (gt_child) delete gt_child;
+
+  split_value = other.split_value;
+  split_var = other.split_var;
+  loss_delta = other.loss_delta;
+  le_child = other.le_child;
+  gt_child = other.gt_child;
+  weight = other.weight;
+  basis_sum.swap(other.basis_sum);
+  valid_idx_begin = other.valid_idx_begin;
+  valid_idx_end = other.valid_idx_end;
+  added_idx.swap(other.added_idx);
+  added_wts.swap(other.added_wts);
+  leaf_id = other.leaf_id;
+
+  other.le_child = NULL;
+  other.gt_child = NULL;
+  return *this;
+}
+
+void Node::train(Features& features, const MatrixView& z_basis,
                  const std::vector<int>& weights,
-                 ivecit valid_idx_begin, ivecit valid_idx_end,
+                 ivecit valid_idx, int valid_idx_begin, int valid_idx_end,
                  int n_train, int n_var, int n_basis, int mtry,
-                 int node_size, double min_loss_delta, int last_var) {
+                 int node_size, double min_loss_delta,
+                 int split_mode, int n_thresholds, int max_depth,
+                 int depth, int last_var) {
   // Trains a node; selects split and recursively trains children.
   //
   // Arguments:
-  //   x_train: pointer to training covariates.
-  //   z_basis: pointer to training basis evaluations.
+  //   features: rank-encoded training covariates.
+  //   z_basis: view of training basis evaluations (column-major).
   //   weights: vector of bootstrap weights.
-  //   valid_idx: pointer to array of valid indices.
+  //   valid_idx: iterator to the tree's array of valid indices.
+  //   valid_idx_begin: offset of the node's first observation.
+  //   valid_idx_end: offset one past the node's last observation.
   //   n_train: number of observations; length of weights.
   //   n_var: number of variables.
   //   n_basis: number of basis functions.
-  //   n_idx: number of valid indices; length of valid_idx.
   //   mtry: number of variables to evaluate for each split.
   //   node_size: minimum weight in each split.
   //   min_loss_delta: the minimum change in loss for a split.
+  //   split_mode: a SplitMode.
+  //   n_thresholds: number of thresholds drawn for random splits.
+  //   max_depth: maximum depth of the tree; 0 for no limit.
+  //   depth: depth of this node.
   //   last_var: the variable sorted; reduces redundant sorts.
   //
   // Side-Effects:
@@ -49,61 +90,168 @@ void Node::train(double* x_train, double* z_basis,
   this -> valid_idx_begin = valid_idx_begin;
   this -> valid_idx_end = valid_idx_end;
 
-  Split best_split = find_best_split(x_train, z_basis, weights, valid_idx_begin,
-                                     valid_idx_end, n_train, n_basis, n_var, mtry,
-                                     node_size, last_var);
+  // Nodes at the maximum depth only need their leaf sums.
+  bool at_limit = max_depth > 0 && depth >= max_depth;
+  Split best_split = evaluate(features, z_basis, weights, valid_idx, n_var,
+                              n_basis, at_limit ? 0 : mtry, node_size,
+                              min_loss_delta, split_mode, n_thresholds,
+                              last_var);
+  if (best_split.var == -1) { return; }
 
-  if (best_split.var == -1) {
-    // Couldn't find a split
-    return;
-  }
+  split(features, valid_idx, best_split, split_mode, last_var);
+
+  // Recursively train children nodes; because splits never reoccur we
+  // can send each its respective part of valid_idx and recurse
+  // without affecting the other side.
+  le_child -> train(features, z_basis, weights, valid_idx,
+                    le_child -> valid_idx_begin, le_child -> valid_idx_end,
+                    n_train, n_var, n_basis, mtry, node_size, min_loss_delta,
+                    split_mode, n_thresholds, max_depth, depth + 1, last_var);
+  gt_child -> train(features, z_basis, weights, valid_idx,
+                    gt_child -> valid_idx_begin, gt_child -> valid_idx_end,
+                    n_train, n_var, n_basis, mtry, node_size, min_loss_delta,
+                    split_mode, n_thresholds, max_depth, depth + 1, last_var);
+}
+
+Split Node::evaluate(Features& features, const MatrixView& z_basis,
+                     const std::vector<int>& weights, ivecit valid_idx,
+                     int n_var, int n_basis, int mtry,
+                     int node_size, double min_loss_delta,
+                     int split_mode, int n_thresholds, int& last_var) {
+  // Finds the best split of the node's observations without applying
+  // it.
+  //
+  // Arguments: as for train; mtry of 0 skips the split search.
+  //
+  // Returns: the best split; var is -1 if the node should remain a
+  //   leaf.
+  //
+  // Side-Effects: keeps the leaf sums of the node and updates
+  //   last_var to the variable the observations are sorted by.
+  int total_weight;
+  std::vector<double> total_sum;
+  Split best_split = find_best_split(features, z_basis, weights,
+                                     valid_idx + valid_idx_begin,
+                                     valid_idx + valid_idx_end,
+                                     n_basis, n_var, mtry,
+                                     node_size, split_mode, n_thresholds,
+                                     last_var, total_weight, total_sum);
+  set_leaf_sums(total_weight, total_sum);
 
-  if (best_split.loss_delta < min_loss_delta) {
+  if (best_split.var != -1 && best_split.loss_delta < min_loss_delta) {
     // Couldn't find a split that achieves the minimum decrease in loss
-    return;
+    best_split.var = -1;
   }
-  loss_delta = best_split.loss_delta;
+  return best_split;
+}
 
+void Node::split(Features& features, ivecit valid_idx, Split& best_split,
+                 int split_mode, int& last_var) {
+  // Applies a split found by evaluate.
+  //
+  // Arguments:
+  //   features: rank-encoded training covariates.
+  //   valid_idx: iterator to the tree's array of valid indices.
+  //   best_split: the split to apply.
+  //   split_mode: a SplitMode.
+  //   last_var: the variable the observations are sorted by.
+  //
+  // Side-Effects: partitions the node's observations, creates
+  //   untrained children over each part and drops the leaf sums.
+  this -> loss_delta = best_split.loss_delta;
   this -> split_var = best_split.var;
-  if (split_var != last_var) {
-    sortby(valid_idx_begin, valid_idx_end, &x_train[split_var * n_train]);
-    last_var = split_var;
+  ivecit begin = valid_idx + valid_idx_begin;
+  ivecit end = valid_idx + valid_idx_end;
+  const RankedColumn& column = features.column(split_var);
+  if (split_mode == RANDOM_SPLIT) {
+    // Partition around the drawn threshold; leaves no variable sorted.
+    auto mid = std::partition(begin, end, [&](int idx) {
+        return column.values[idx] <= best_split.value;
+      });
+    best_split.offset = mid - begin - 1;
+    this -> split_value = best_split.value;
+    last_var = -1;
+  } else {
+    if (split_var != last_var) {
+      sortby(begin, end, column.ranks.data(), column.n_bits, features.buffer);
+      last_var = split_var;
+    }
+
+    this -> split_value = column.value(*(begin + best_split.offset));
   }
 
-  this -> split_value = x_train[split_var * n_train + *(valid_idx_begin + best_split.offset)];
+  this -> weight = 0;
+  std::vector<double>().swap(this -> basis_sum);
 
-  // Recursively train children nodes; because splits never reoccur we
-  // can send each its respective part of valid_idx and recurse
-  // without affecting the other side.
   le_child = new Node;
-  le_child -> train(x_train, z_basis, weights,
-                    valid_idx_begin, valid_idx_begin + best_split.offset + 1,
-                    n_train, n_var, n_basis, mtry, node_size, last_var);
+  le_child -> valid_idx_begin = valid_idx_begin;
+  le_child -> valid_idx_end = valid_idx_begin + best_split.offset + 1;
 
   gt_child = new Node;
-  gt_child -> train(x_train, z_basis, weights,
-                    valid_idx_begin + best_split.offset + 1, valid_idx_end,
-                    n_train, n_var, n_basis, mtry, node_size, last_var);
+  gt_child -> valid_idx_begin = valid_idx_begin + best_split.offset + 1;
+  gt_child -> valid_idx_end = valid_idx_end;
 }
 
-double full_loss(double* x_train, double* z_basis,
-                 const std::vector<int>& weights,
-                 ivecit idx_begin, ivecit idx_end,
-                 int n_train, int n_basis) {
-
-  // Initialize total_sum and total_weight
-  int total_weight = 0;
-  std::vector<double> total_sum(n_basis, 0.0);
-  for (auto it = idx_begin; it != idx_end; ++it) {
-    total_weight += weights[*it];
-    for (int bb = 0; bb < n_basis; bb++) {
-      total_sum[bb] += z_basis[bb * n_train + *it] * weights[*it];
-    }
+void Node::set_leaf_sums(int total_weight, std::vector<double>& total_sum) {
+  // Keeps the weighted basis sums of a leaf node.
+  //
+  // The mean basis vector basis_sum / weight is the projection
+  // density estimate for the leaf.
+  this -> weight = total_weight;
+  this -> basis_sum.swap(total_sum);
+}
+
+void Node::save(std::ostream& out) const {
+  // Writes the node and its children in pre-order.
+  write_value(out, split_var);
+  write_value(out, split_value);
+  write_value(out, loss_delta);
+  write_value(out, weight);
+  write_value(out, valid_idx_begin);
+  write_value(out, valid_idx_end);
+  write_vector(out, basis_sum);
+  write_vector(out, added_idx);
+  write_vector(out, added_wts);
+  if (split_var != -1) {
+    le_child -> save(out);
+    gt_child -> save(out);
   }
+}
 
-  double loss = 0.0;
-  for (int bb = 0; bb < n_basis; bb++) {
-    loss -= (total_sum[bb] * total_sum[bb]) / total_weight;
+void Node::load(std::istream& in, int n_blocks, int n_idx, int n_train,
+                int n_basis) {
+  // Reads a node and its children written by save.
+  //
+  // Arguments:
+  //   in: stream to read from.
+  //   n_blocks: number of covariate blocks of the tree.
+  //   n_idx: length of the tree's valid_idx.
+  //   n_train: number of training observations.
+  //   n_basis: number of basis functions.
+  read_value(in, split_var);
+  read_value(in, split_value);
+  read_value(in, loss_delta);
+  read_value(in, weight);
+  read_value(in, valid_idx_begin);
+  read_value(in, valid_idx_end);
+  read_vector(in, basis_sum);
+  read_vector(in, added_idx);
+  read_vector(in, added_wts);
+  if (split_var < -1 || split_var >= n_blocks || valid_idx_begin < 0 ||
+      valid_idx_begin > valid_idx_end || valid_idx_end > n_idx ||
+      basis_sum.size() > static_cast<size_t>(n_basis) ||
+      added_wts.size() != added_idx.size()) {
+    throw std::invalid_argument("Corrupt serialized tree");
+  }
+  for (auto &idx : added_idx) {
+    if (idx < 0 || idx >= n_train) {
+      throw std::invalid_argument("Corrupt serialized tree");
+    }
+  }
+  if (split_var != -1) {
+    le_child = new Node;
+    le_child -> load(in, n_blocks, n_idx, n_train, n_basis);
+    gt_child = new Node;
+    gt_child -> load(in, n_blocks, n_idx, n_train, n_basis);
   }
-  return loss;
 }
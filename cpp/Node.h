@@ -4,6 +4,8 @@
 #ifndef NODE_GUARD
 #define NODE_GUARD
 #include <algorithm>
+#include <istream>
+#include <ostream>
 #include <vector>
 #include "Split.h"
 
@@ -16,26 +18,49 @@ public:
   double loss_delta; // difference in density loss for this split.
   Node* le_child; // pointer to <= child. NULL if no children.
   Node* gt_child; // pointer to > child. NULL if no children.
-  ivecit valid_idx_begin;
-  ivecit valid_idx_end;
+  int weight; // total bootstrap weight; only kept for leaf nodes.
+  std::vector<double> basis_sum; // weighted basis sums; only kept for leaf nodes.
+  int valid_idx_begin; // offset of the first observation in the tree's valid_idx.
+  int valid_idx_end; // offset one past the last observation.
+  std::vector<int> added_idx; // observations added after training; only kept for leaf nodes.
+  std::vector<int> added_wts; // weight of each observation in added_idx.
+  int leaf_id; // index among the leaves of the tree; -1 if not a leaf.
 
   Node();
   ~Node();
 
-  bool is_leaf() {
+  // Nodes own their children so they can be moved but not copied.
+  Node(const Node&) = delete;
+  Node& operator=(const Node&) = delete;
+  Node(Node&& other) noexcept;
+  Node& operator=(Node&& other) noexcept;
+
+  bool is_leaf() const {
     return(this -> split_var == -1);
   }
 
-  void train(double* x_train, double* z_basis,
+  void train(Features& features, const MatrixView& z_basis,
              const std::vector<int>& weights,
-             ivecit valid_idx_begin, ivecit valid_idx_end,
+             ivecit valid_idx, int valid_idx_begin, int valid_idx_end,
              int n_train, int n_var, int n_basis, int mtry,
-             int node_size, double min_loss_delta, int last_var=-1);
-};
+             int node_size, double min_loss_delta,
+             int split_mode, int n_thresholds, int max_depth,
+             int depth=0, int last_var=-1);
+
+  Split evaluate(Features& features, const MatrixView& z_basis,
+                 const std::vector<int>& weights, ivecit valid_idx,
+                 int n_var, int n_basis, int mtry,
+                 int node_size, double min_loss_delta,
+                 int split_mode, int n_thresholds, int& last_var);
 
-double full_loss(double* x_train, double* z_basis,
-                 const std::vector<int>& weights,
-                 ivecit idx_begin, ivecit idx_end,
-                 int n_train, int n_basis);
+  void split(Features& features, ivecit valid_idx, Split& best_split,
+             int split_mode, int& last_var);
+
+  void set_leaf_sums(int total_weight, std::vector<double>& total_sum);
+
+  void save(std::ostream& out) const;
+  void load(std::istream& in, int n_blocks, int n_idx, int n_train,
+            int n_basis);
+};
 
 #endif
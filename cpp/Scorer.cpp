@@ -0,0 +1,202 @@
+// Copyright Taylor Pospisil 2018.
+// Distributed under MIT License (http://opensource.org/licenses/MIT)
+
+#include <stdint.h>
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <vector>
+#include "Scorer.h"
+#include "Forest.h"
+
+namespace {
+  // Rows scored together; their bitvectors share the pass over the
+  // conditions of each feature.
+  const int block_rows = 8;
+
+  typedef std::vector<std::vector<BitvectorScorer::Condition> > Conditions;
+
+  bool by_threshold(const BitvectorScorer::Condition& lhs,
+                    const BitvectorScorer::Condition& rhs) {
+    return lhs.threshold < rhs.threshold;
+  }
+
+  void clear_bits(uint64_t* words, int64_t lo, int64_t hi) {
+    // Clears bits [lo, hi) of a bitvector.
+    int64_t lo_word = lo >> 6;
+    int64_t hi_word = (hi - 1) >> 6;
+    uint64_t lo_mask = ~uint64_t(0) << (lo & 63);
+    uint64_t hi_mask = ~uint64_t(0) >> (63 - ((hi - 1) & 63));
+    if (lo_word == hi_word) {
+      words[lo_word] &= ~(lo_mask & hi_mask);
+      return;
+    }
+    words[lo_word] &= ~lo_mask;
+    for (int64_t ww = lo_word + 1; ww < hi_word; ww++) { words[ww] = 0; }
+    words[hi_word] &= ~hi_mask;
+  }
+
+  int lowest_bit(uint64_t word) {
+#ifdef __GNUC__
+    return __builtin_ctzll(word);
+#else
+    int bit = 0;
+    while (!((word >> bit) & 1)) { bit++; }
+    return bit;
+#endif
+  }
+
+  std::pair<int, int> collect(const Tree& tree, const Node* node,
+                              int64_t offset,
+                              std::map<std::pair<int, int>, int>& ids,
+                              BitvectorScorer& scorer,
+                              Conditions& by_feature) {
+    // Adds the conditions of a subtree grouped by feature.
+    //
+    // Arguments:
+    //   tree: tree containing the subtree.
+    //   node: root of the subtree.
+    //   offset: first bit of the tree's bitvector.
+    //   ids: feature id of each block of covariates.
+    //   scorer: scorer whose feature blocks are extended.
+    //   by_feature: conditions of each feature.
+    //
+    // Returns: the range [first, last) of leaf ids in the subtree.
+    if (node -> is_leaf()) {
+      return std::make_pair(node -> leaf_id, node -> leaf_id + 1);
+    }
+    std::pair<int, int> le = collect(tree, node -> le_child, offset, ids,
+                                     scorer, by_feature);
+    std::pair<int, int> gt = collect(tree, node -> gt_child, offset, ids,
+                                     scorer, by_feature);
+
+    int var = node -> split_var;
+    std::pair<int, int> block(tree.starts[var], tree.ends[var]);
+    std::map<std::pair<int, int>, int>::iterator it = ids.find(block);
+    if (it == ids.end()) {
+      it = ids.insert(std::make_pair(block, static_cast<int>(ids.size()))).first;
+      scorer.feature_start.push_back(block.first);
+      scorer.feature_end.push_back(block.second);
+      scorer.feature_prefix.push_back(tree.prefix_lo[var]);
+      by_feature.resize(ids.size());
+    }
+
+    BitvectorScorer::Condition condition;
+    condition.threshold = node -> split_value;
+    condition.bit_lo = offset + le.first;
+    condition.bit_hi = offset + le.second;
+    by_feature[it -> second].push_back(condition);
+    return std::make_pair(le.first, gt.second);
+  }
+}
+
+void BitvectorScorer::build(const Forest& forest) {
+  // Collects the split conditions of a trained forest.
+  //
+  // The forest must outlive the scorer and not change structure;
+  // observations may still be added since they do not move leaves.
+  //
+  // Arguments:
+  //   forest: the trained forest.
+  //
+  // Side-Effects: replaces the conditions, features and bitvectors.
+  this -> prefix = &forest.prefix;
+  this -> n_var = forest.n_var;
+
+  size_t n_trees = forest.trees.size();
+  word_begin.assign(1, 0);
+  for (size_t tt = 0; tt < n_trees; tt++) {
+    word_begin.push_back(word_begin.back() +
+                         (forest.trees[tt].n_leaves() + 63) / 64);
+  }
+  init.assign(word_begin.back(), 0);
+
+  std::map<std::pair<int, int>, int> ids;
+  Conditions by_feature;
+  feature_start.clear();
+  feature_end.clear();
+  feature_prefix.clear();
+  for (size_t tt = 0; tt < n_trees; tt++) {
+    int64_t offset = static_cast<int64_t>(word_begin[tt]) * 64;
+    for (int ll = 0; ll < forest.trees[tt].n_leaves(); ll++) {
+      init[(offset + ll) >> 6] |= uint64_t(1) << ((offset + ll) & 63);
+    }
+    collect(forest.trees[tt], &forest.trees[tt].root, offset, ids, *this,
+            by_feature);
+  }
+
+  conditions.clear();
+  feature_begin.assign(1, 0);
+  for (size_t ff = 0; ff < by_feature.size(); ff++) {
+    std::stable_sort(by_feature[ff].begin(), by_feature[ff].end(),
+                     by_threshold);
+    conditions.insert(conditions.end(), by_feature[ff].begin(),
+                      by_feature[ff].end());
+    feature_begin.push_back(conditions.size());
+  }
+}
+
+void BitvectorScorer::apply(const MatrixView& x_test, int first, int last,
+                            int* leaf_ids) const {
+  // Finds the leaf of each tree containing each of a range of rows.
+  //
+  // Rows are scored in blocks: every feature's conditions are
+  // scanned once per block, each row stopping at the first condition
+  // it satisfies. Failing a condition (feature > threshold) rules
+  // out the leaves of the node's <= subtree.
+  //
+  // Arguments:
+  //   x_test: view of the new observations.
+  //   first: first row to score.
+  //   last: one past the last row to score.
+  //   leaf_ids: pointer to a buffer of rows of n_trees leaf ids
+  //     (row-major) starting at row 0 of x_test.
+  //
+  // Side-Effects: fills rows [first, last) of leaf_ids.
+  int n_trees = word_begin.size() - 1;
+  int n_features = feature_start.size();
+  size_t n_words = init.size();
+
+  std::vector<uint64_t> bits(block_rows * n_words);
+  std::vector<double> values(static_cast<size_t>(n_features) * block_rows);
+  std::vector<double> row(n_var);
+  std::vector<double> row_prefix;
+  for (int block = first; block < last; block += block_rows) {
+    int n_rows = std::min(block_rows, last - block);
+    for (int rr = 0; rr < n_rows; rr++) {
+      x_test.row(block + rr, n_var, row.data());
+      prefix -> row(row.data(), row_prefix);
+      for (int ff = 0; ff < n_features; ff++) {
+        // Matches Tree::calculate_feature.
+        int lo = feature_prefix[ff];
+        values[ff * block_rows + rr] = (lo < 0) ? row[feature_start[ff]] :
+          row_prefix[lo + feature_end[ff] - feature_start[ff]] -
+          row_prefix[lo];
+      }
+      std::copy(init.begin(), init.end(), bits.begin() + rr * n_words);
+    }
+
+    for (int ff = 0; ff < n_features; ff++) {
+      for (int rr = 0; rr < n_rows; rr++) {
+        double value = values[ff * block_rows + rr];
+        uint64_t* row_bits = &bits[rr * n_words];
+        // NaN fails every condition, as in Tree::traverse.
+        for (int kk = feature_begin[ff];
+             kk < feature_begin[ff + 1] && !(value <= conditions[kk].threshold);
+             kk++) {
+          clear_bits(row_bits, conditions[kk].bit_lo, conditions[kk].bit_hi);
+        }
+      }
+    }
+
+    for (int rr = 0; rr < n_rows; rr++) {
+      const uint64_t* row_bits = &bits[rr * n_words];
+      int* leaf_row = leaf_ids + static_cast<size_t>(block + rr) * n_trees;
+      for (int tt = 0; tt < n_trees; tt++) {
+        int ww = word_begin[tt];
+        while (row_bits[ww] == 0) { ww++; }
+        leaf_row[tt] = (ww - word_begin[tt]) * 64 + lowest_bit(row_bits[ww]);
+      }
+    }
+  }
+}
@@ -0,0 +1,47 @@
+// Copyright Taylor Pospisil 2018.
+// Distributed under MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef SCORER_GUARD
+#define SCORER_GUARD
+#include <stdint.h>
+#include <vector>
+#include "Features.h"
+#include "Matrix.h"
+
+class Forest;
+
+// Batch traversal in the style of QuickScorer (Lucchese et al., 2015).
+//
+// Each tree keeps a bitvector of candidate leaves, numbered left to
+// right by leaf_id. Split conditions of every tree are grouped by
+// feature and sorted by threshold so that a row only visits the
+// conditions it fails; each failed condition clears the leaves of
+// the node's <= subtree and the exit leaf of a tree is its lowest
+// remaining bit. Leaves of a subtree are contiguous so conditions
+// store leaf ranges rather than full masks.
+class BitvectorScorer {
+ public:
+  struct Condition {
+    double threshold;
+    int64_t bit_lo; // first cleared bit of the concatenated bitvectors.
+    int64_t bit_hi; // one past the last cleared bit.
+  };
+
+  std::vector<Condition> conditions; // grouped by feature, sorted by threshold.
+  std::vector<int> feature_begin; // offset of each feature's conditions; length n_features + 1.
+  std::vector<int> feature_start; // first covariate of each feature's block.
+  std::vector<int> feature_end; // one past the last covariate of the block.
+  std::vector<int> feature_prefix; // prefix column preceding each block; -1 for singletons.
+  std::vector<int> word_begin; // offset of each tree's bitvector; length n_trees + 1.
+  std::vector<uint64_t> init; // bitvectors with every leaf set.
+  const PrefixSums* prefix; // prefix sums of the forest it was built from.
+  int n_var;
+
+  BitvectorScorer() : prefix(NULL), n_var(0) {}
+
+  void build(const Forest& forest);
+  void apply(const MatrixView& x_test, int first, int last,
+             int* leaf_ids) const;
+};
+
+#endif
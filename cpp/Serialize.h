@@ -0,0 +1,53 @@
+// Copyright Taylor Pospisil 2018.
+// Distributed under MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef SERIALIZE_GUARD
+#define SERIALIZE_GUARD
+#include <stdint.h>
+#include <algorithm>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+// Binary serialization of plain values and vectors in native byte
+// order; vectors are prefixed by their length.
+
+template<class T>
+void write_value(std::ostream& out, const T& value) {
+  out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<class T>
+void read_value(std::istream& in, T& value) {
+  in.read(reinterpret_cast<char*>(&value), sizeof(T));
+  if (!in) { throw std::runtime_error("Truncated serialized forest"); }
+}
+
+template<class T>
+void write_vector(std::ostream& out, const std::vector<T>& values) {
+  uint64_t size = values.size();
+  write_value(out, size);
+  if (size > 0) {
+    out.write(reinterpret_cast<const char*>(values.data()), size * sizeof(T));
+  }
+}
+
+template<class T>
+void read_vector(std::istream& in, std::vector<T>& values) {
+  // Reads in bounded chunks so that a corrupt length runs out of
+  // stream rather than allocating.
+  const uint64_t chunk = 1 << 16;
+  uint64_t size;
+  read_value(in, size);
+  values.clear();
+  while (values.size() < size) {
+    size_t offset = values.size();
+    size_t n_read = static_cast<size_t>(std::min(chunk, size - offset));
+    values.resize(offset + n_read);
+    in.read(reinterpret_cast<char*>(values.data() + offset), n_read * sizeof(T));
+    if (!in) { throw std::runtime_error("Truncated serialized forest"); }
+  }
+}
+
+#endif
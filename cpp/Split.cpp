@@ -9,64 +9,115 @@
 
 typedef std::vector<int>::iterator ivecit;
 
-Split find_best_split(double* x_train, double* z_basis,
-                      const std::vector<int>& weights,
-                      ivecit idx_begin, ivecit idx_end,
-                      int n_train, int n_basis, int n_var, int mtry,
-                      int node_size, int& last_var) {
-  Split best_split;
+namespace {
+  template<class BASIS>
+  Split find_split(Features& features, const BASIS* z_basis,
+                   const std::vector<int>& weights,
+                   ivecit idx_begin, ivecit idx_end,
+                   int z_stride, int n_basis, int n_var, int mtry,
+                   int node_size, int split_mode, int n_thresholds,
+                   int& last_var, int& total_weight,
+                   std::vector<double>& total_sum) {
+    Split best_split;
 
-  // Initialize total_sum and total_weight
-  int total_weight = 0;
-  std::vector<double> total_sum(n_basis, 0.0);
-  for (auto it = idx_begin; it != idx_end; ++it) {
-    total_weight += weights[*it];
-    for (int bb = 0; bb < n_basis; bb++) {
-      total_sum[bb] += z_basis[bb * n_train + *it] * weights[*it];
+    // Initialize total_sum and total_weight
+    total_weight = 0;
+    total_sum.assign(n_basis, 0.0);
+    for (auto it = idx_begin; it != idx_end; ++it) {
+      total_weight += weights[*it];
+      for (int bb = 0; bb < n_basis; bb++) {
+        total_sum[bb] += static_cast<double>(z_basis[bb * z_stride + *it]) *
+          weights[*it];
+      }
     }
-  }
 
-  // Can quit early if not enough weight for split
-  if (total_weight < 2 * node_size) {
-    return best_split;
-  }
+    // Can quit early if not enough weight for split
+    if (total_weight < 2 * node_size) {
+      return best_split;
+    }
 
-  double initial_loss = 0.0;
-  for (int bb = 0; bb < n_basis; bb++) {
-    initial_loss -= total_sum[bb] / total_weight * total_sum[bb];
-  }
+    double initial_loss = 0.0;
+    for (int bb = 0; bb < n_basis; bb++) {
+      initial_loss -= total_sum[bb] / total_weight * total_sum[bb];
+    }
 
-  static auto rng = std::default_random_engine {};
-  std::vector<int> vars(n_var);
-  std::iota(vars.begin(), vars.end(), 0);
-  std::shuffle(vars.begin(), vars.end(), rng);
+    // Draw candidates with a partial Fisher-Yates shuffle of the
+    // persistent permutation in features.
+    std::default_random_engine& rng = *features.rng;
+    std::vector<int>& vars = features.vars;
 
-  for (int ii = 0; ii < mtry; ii++) {
-    int var = vars[ii];
-    if (var != last_var) {
-      sortby(idx_begin, idx_end, &x_train[var * n_train]);
-      last_var = var;
-    }
+    for (int ii = 0; ii < mtry; ii++) {
+      std::uniform_int_distribution<int> rvar(ii, n_var - 1);
+      std::swap(vars[ii], vars[rvar(rng)]);
+      int var = vars[ii];
+      const RankedColumn& column = features.column(var);
+
+      Split split;
+      if (split_mode == RANDOM_SPLIT) {
+        split = evaluate_random_split(column, z_basis, weights, idx_begin,
+                                      idx_end, z_stride, n_basis, node_size,
+                                      n_thresholds, total_weight, total_sum, rng);
+      } else {
+        if (var != last_var) {
+          sortby(idx_begin, idx_end, column.ranks.data(), column.n_bits,
+                 features.buffer);
+          last_var = var;
+        }
 
-    Split split = evaluate_split(&x_train[var * n_train],
-                                 z_basis, weights, idx_begin, idx_end,
-                                 n_train, n_basis, node_size,
-                                 total_weight, total_sum);
+        split = evaluate_split(column.ranks.data(),
+                               z_basis, weights, idx_begin, idx_end,
+                               z_stride, n_basis, node_size,
+                               total_weight, total_sum);
+      }
 
-    if (split.loss_delta < best_split.loss_delta) {
-      best_split = split;
-      best_split.var = var;
+      if (split.loss_delta < best_split.loss_delta) {
+        best_split = split;
+        best_split.var = var;
+      }
     }
+
+    best_split.loss_delta = initial_loss - best_split.loss_delta;
+    return best_split;
   }
+}
 
-  best_split.loss_delta = initial_loss - best_split.loss_delta;
-  return best_split;
+Split find_best_split(Features& features, const MatrixView& z_basis,
+                      const std::vector<int>& weights,
+                      ivecit idx_begin, ivecit idx_end,
+                      int n_basis, int n_var, int mtry, int node_size,
+                      int split_mode, int n_thresholds,
+                      int& last_var, int& total_weight,
+                      std::vector<double>& total_sum) {
+  // Finds the best split among mtry randomly selected variables.
+  //
+  // With split_mode RANDOM_SPLIT only n_thresholds random thresholds
+  // are scored for each variable on unranked columns, so neither
+  // observations nor columns are sorted.
+  // The basis evaluations must be column-major, though columns may be
+  // padded past the training rows (z_basis.col_stride) so that appended
+  // observations do not move them; the split search is instantiated
+  // for their storage type.
+  //
+  // Side-Effects: sets total_weight and total_sum to the weight and
+  //   weighted basis sums of the node; these are kept by leaf nodes.
+  int z_stride = static_cast<int>(z_basis.col_stride);
+  if (z_basis.dtype == FLOAT32) {
+    return find_split(features, static_cast<const float*>(z_basis.data),
+                      weights, idx_begin, idx_end, z_stride, n_basis, n_var,
+                      mtry, node_size, split_mode, n_thresholds, last_var,
+                      total_weight, total_sum);
+  }
+  return find_split(features, static_cast<const double*>(z_basis.data),
+                    weights, idx_begin, idx_end, z_stride, n_basis, n_var,
+                    mtry, node_size, split_mode, n_thresholds, last_var,
+                    total_weight, total_sum);
 }
 
-Split evaluate_split(const double* x_train, const double* z_basis,
+template<class BASIS>
+Split evaluate_split(const uint32_t* ranks, const BASIS* z_basis,
                      const std::vector<int>& weights,
                      const ivecit idx_begin, const ivecit idx_end,
-                     int n_train, int n_basis, int node_size,
+                     int z_stride, int n_basis, int node_size,
                      int total_weight, const std::vector<double>& total_sum) {
   // Finds the best split given an ordering of observations.
   //
@@ -77,11 +128,12 @@ Split evaluate_split(const double* x_train, const double* z_basis,
   // for each side of the split.
   //
   // Arguments:
-  //   x_train: pointer to covariate vector.
+  //   ranks: pointer to covariate ranks.
   //   z_basis: pointer to basis function evaluations.
   //   weights: vector of bootstrap weights.
   //   idx: pointer to array of valid indices.
-  //   n_train: number of observations, length of weights.
+  //   z_stride: distance between basis function columns; at least
+  //     the number of observations.
   //   n_basis: number of basis functions.
   //   n_idx: number of valid indices.
   //   node_size: minimum weight for a leaf node.
@@ -103,7 +155,8 @@ Split evaluate_split(const double* x_train, const double* z_basis,
     // Update for next observation
     le_weight += weights[*it];
     for (int bb = 0; bb < n_basis; bb++) {
-      le_sum[bb] += z_basis[n_train * bb + *it] * weights[*it];
+      le_sum[bb] += static_cast<double>(z_basis[z_stride * bb + *it]) *
+        weights[*it];
     }
 
     // Enforce node_size constraint on minimum weight in a leaf node.
@@ -111,7 +164,7 @@ Split evaluate_split(const double* x_train, const double* z_basis,
     if (total_weight - le_weight < node_size) { break; }
 
     // Enforce <= constraint
-    if (x_train[*it] == x_train[*(it + 1)]) { continue; }
+    if (ranks[*it] == ranks[*(it + 1)]) { continue; }
 
     // Calculate loss
     double loss = 0.0;
@@ -129,3 +182,111 @@ Split evaluate_split(const double* x_train, const double* z_basis,
 
   return split;
 }
+
+template<class BASIS>
+Split evaluate_random_split(const RankedColumn& column, const BASIS* z_basis,
+                            const std::vector<int>& weights,
+                            const ivecit idx_begin, const ivecit idx_end,
+                            int z_stride, int n_basis, int node_size,
+                            int n_thresholds, int total_weight,
+                            const std::vector<double>& total_sum,
+                            std::default_random_engine& rng) {
+  // Finds the best of randomly drawn thresholds for a covariate.
+  //
+  // Thresholds are drawn uniformly between the smallest and largest
+  // covariate values in the node. Observations are binned between
+  // consecutive thresholds in a single unsorted pass with a binary
+  // search over the thresholds; cumulative sums over the bins give
+  // the weights and basis sums on the <= side of each threshold.
+  //
+  // Arguments:
+  //   column: unranked covariate; values holds the raw values.
+  //   z_basis: pointer to basis function evaluations.
+  //   weights: vector of bootstrap weights.
+  //   idx_begin, idx_end: range of valid indices.
+  //   z_stride: distance between basis function columns; at least
+  //     the number of observations.
+  //   n_basis: number of basis functions.
+  //   node_size: minimum weight for a leaf node.
+  //   n_thresholds: number of thresholds to draw.
+  //   total_weight: sum of weights for valid indices.
+  //   total_sum: vector of weighted sums of basis functions.
+  //   rng: random number generator for the thresholds.
+  //
+  // Returns: a Split object containing the best split loss and the
+  //   drawn threshold.
+  Split split;
+  split.loss_delta = 0.0; // initialize zero as losses are negative
+
+  const std::vector<double>& x = column.values;
+  double lo = x[*idx_begin];
+  double hi = lo;
+  for (auto it = idx_begin; it != idx_end; ++it) {
+    lo = std::min(lo, x[*it]);
+    hi = std::max(hi, x[*it]);
+  }
+  if (!(lo < hi)) { return split; }
+
+  // Thresholds lie in [lo, hi) so the largest value is always sent to
+  // the > child.
+  std::uniform_real_distribution<double> runif(lo, hi);
+  std::vector<double> cuts(n_thresholds);
+  for (int kk = 0; kk < n_thresholds; kk++) { cuts[kk] = runif(rng); }
+  std::sort(cuts.begin(), cuts.end());
+
+  // Bin kk holds observations with value in (cuts[kk - 1], cuts[kk]].
+  std::vector<int> bin_weight(n_thresholds + 1, 0);
+  std::vector<double> bin_sum((n_thresholds + 1) * n_basis, 0.0);
+  for (auto it = idx_begin; it != idx_end; ++it) {
+    if (weights[*it] == 0) { continue; }
+    int bin = std::lower_bound(cuts.begin(), cuts.end(), x[*it]) -
+      cuts.begin();
+    bin_weight[bin] += weights[*it];
+    for (int bb = 0; bb < n_basis; bb++) {
+      bin_sum[bin * n_basis + bb] +=
+        static_cast<double>(z_basis[z_stride * bb + *it]) * weights[*it];
+    }
+  }
+
+  int le_weight = 0;
+  std::vector<double> le_sum(n_basis, 0.0);
+  for (int kk = 0; kk < n_thresholds; kk++) {
+    le_weight += bin_weight[kk];
+    for (int bb = 0; bb < n_basis; bb++) {
+      le_sum[bb] += bin_sum[kk * n_basis + bb];
+    }
+
+    // Enforce node_size constraint on minimum weight in a leaf node.
+    if (le_weight < node_size) { continue; }
+    if (total_weight - le_weight < node_size) { break; }
+
+    double loss = 0.0;
+    for (int bb = 0; bb < n_basis; bb++) {
+      loss -= le_sum[bb] * le_sum[bb] / le_weight;
+      loss -= (total_sum[bb] - le_sum[bb]) * (total_sum[bb] - le_sum[bb]) /
+        (total_weight - le_weight);
+    }
+
+    if (loss < split.loss_delta) {
+      split.loss_delta = loss;
+      split.value = cuts[kk];
+    }
+  }
+
+  return split;
+}
+
+template Split evaluate_split<float>(
+    const uint32_t*, const float*, const std::vector<int>&, const ivecit,
+    const ivecit, int, int, int, int, const std::vector<double>&);
+template Split evaluate_split<double>(
+    const uint32_t*, const double*, const std::vector<int>&, const ivecit,
+    const ivecit, int, int, int, int, const std::vector<double>&);
+template Split evaluate_random_split<float>(
+    const RankedColumn&, const float*, const std::vector<int>&, const ivecit,
+    const ivecit, int, int, int, int, int, const std::vector<double>&,
+    std::default_random_engine&);
+template Split evaluate_random_split<double>(
+    const RankedColumn&, const double*, const std::vector<int>&, const ivecit,
+    const ivecit, int, int, int, int, int, const std::vector<double>&,
+    std::default_random_engine&);
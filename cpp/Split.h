@@ -3,29 +3,52 @@
 
 #ifndef SPLIT_GUARD
 #define SPLIT_GUARD
+#include <stdint.h>
 #include <vector>
+#include <random>
+#include "Features.h"
+#include "Matrix.h"
 
 typedef std::vector<int>::iterator ivecit;
 
+// Strategies for choosing split points: the best split over sorted
+// observations or the best of randomly drawn thresholds.
+enum SplitMode { BEST_SPLIT = 0, RANDOM_SPLIT = 1 };
+
 class Split {
  public:
   int var;
   int offset;
   double loss_delta;
+  double value; // drawn threshold; random splits only.
 
- Split() : var(-1), offset(-1), loss_delta(0.0) {}
+ Split() : var(-1), offset(-1), loss_delta(0.0), value(0.0) {}
 };
 
-Split find_best_split(double* x_train, double* z_basis,
+Split find_best_split(Features& features, const MatrixView& z_basis,
                       const std::vector<int>& weights,
                       ivecit idx_begin, ivecit idx_end,
-                      int n_train, int n_basis, int n_var, int mtry, int node_size,
-                      int& last_var);
+                      int n_basis, int n_var, int mtry, int node_size,
+                      int split_mode, int n_thresholds,
+                      int& last_var, int& total_weight,
+                      std::vector<double>& total_sum);
 
-Split evaluate_split(const double* x_train, const double* z_basis,
+// Basis evaluations are stored as float or double; sums are always
+// accumulated in double.
+template<class BASIS>
+Split evaluate_split(const uint32_t* ranks, const BASIS* z_basis,
                      const std::vector<int>& weights,
                      const ivecit idx_begin, const ivecit idx_end,
-                     int n_train, int n_basis, int node_size,
+                     int z_stride, int n_basis, int node_size,
                      int total_weight, const std::vector<double>& total_sum);
 
+template<class BASIS>
+Split evaluate_random_split(const RankedColumn& column, const BASIS* z_basis,
+                            const std::vector<int>& weights,
+                            const ivecit idx_begin, const ivecit idx_end,
+                            int z_stride, int n_basis, int node_size,
+                            int n_thresholds, int total_weight,
+                            const std::vector<double>& total_sum,
+                            std::default_random_engine& rng);
+
 #endif
@@ -3,122 +3,314 @@
 
 #include <vector>
 #include <random>
-#include <stdlib.h>
+#include <stdexcept>
+#include <queue>
+#include <numeric>
+#include <algorithm>
+#include <utility>
 #include "Tree.h"
 #include "Node.h"
 #include "helpers.h"
+#include "Serialize.h"
 
-void Tree::train(double* x_train, double* z_basis, int* lens,
-                 const std::vector<int>& weights,
-                 int n_train, int n_var, int n_basis, int mtry, int node_size,
-                 double min_loss_delta, double flambda, bool fit_oob) {
+void Tree::train(const Partition& partition, Features& features,
+                 const MatrixView& z_basis, const std::vector<int>& weights,
+                 const std::vector<int>& sample_idx,
+                 int n_train, int n_basis, int mtry, int node_size,
+                 double min_loss_delta, int split_mode, int n_thresholds,
+                 int max_depth, int max_leaf_nodes,
+                 std::default_random_engine& rng) {
   // Train Tree object on training covariates and responses.
   //
   // Arguments:
-  //   x_train: pointer to training covariates
-  //   z_basis: pointer to basis function evaluatations of training responses.
-  //   lens: length of functional variables
+  //   partition: blocks of covariates aggregated into features.
+  //   features: rank-encoded features for the blocks of partition.
+  //   z_basis: view of basis function evaluations of training responses
+  //     (column-major).
   //   weights: vector of bootstrapped weights.
+  //   sample_idx: indices of the observations placed in the tree.
   //   n_train: number of training observations.
-  //   n_var: number of training covariates.
   //   n_basis: number of basis functions.
   //   mtry: number of variables to evaluate for each split.
   //   node_size: minimum weight in a leaf node.
   //   min_loss_delta: the minimum change in loss for a split.
-  //   flambda: lambda used for grouping functional data
-  //   fit_oob: boolean whether to fit out-of-bag samples. Allows
-  //     estimation of out-of-bag loss at the cost of increased
-  //     computational effort.
+  //   split_mode: a SplitMode.
+  //   n_thresholds: number of thresholds drawn for random splits.
+  //   max_depth: maximum depth of the tree; 0 for no limit.
+  //   max_leaf_nodes: maximum number of leaves; 0 for no limit. When
+  //     limited the tree is grown best-first, splitting the leaf with
+  //     the largest decrease in loss.
+  //   rng: random engine of the tree.
   //
   // Side-Effects:
   //   Builds a tree for prediction in root.
   this -> n_train = n_train;
+  this -> valid_idx = sample_idx;
+  this -> starts = partition.starts;
+  this -> ends = partition.ends;
 
-  std::vector<int> valid_idx(n_train);
-  for (int ii = 0; ii < n_train; ii++) { valid_idx[ii] = ii; }
+  int n_var = this -> ends.size();
 
-
-  this -> valid_idx = valid_idx;
-  this -> wts = weights;
-
-  // Select features
-  std::vector<int> starts;
-  std::vector<int> ends;
-  int idx = 0;
-  int lens_id = 0;
-  int cur_len = lens[lens_id];
-
-  static auto rng = std::default_random_engine {};
-  std::poisson_distribution<int> rpois(flambda);
-
-  while(idx < n_var) {
-    int jump = rpois(rng);
-    if (jump > cur_len) {
-      jump = cur_len;
-      // todo: fix this?
-    }
-    if (jump == 0) { continue; }
-    cur_len -= jump;
-    starts.push_back(idx);
-    idx += jump;
-    ends.push_back(idx);
-    if (cur_len == 0 && idx != n_var) {
-      lens_id += 1;
-      cur_len = lens[lens_id];
+  // Aggregated blocks are evaluated from the prefix sums of new
+  // observations at prediction.
+  this -> prefix_lo.assign(n_var, -1);
+  for (int ii = 0; ii < n_var; ii++) {
+    if (this -> ends[ii] - this -> starts[ii] > 1) {
+      this -> prefix_lo[ii] = features.prefix -> before[this -> starts[ii]];
     }
   }
+  // Candidate draws only depend on the tree's own random stream.
+  features.rng = &rng;
+  std::iota(features.vars.begin(), features.vars.end(), 0);
 
-  n_var = ends.size();
-  double* xs_train = (double*) malloc(sizeof(double) * n_var * n_train);
-  for (int ii = 0; ii < n_var; ii++) {
-    for (int jj = 0; jj < n_train; jj++) {
-      double val = 0.0;
-      for (int idx = starts[ii]; idx < ends[ii]; ++idx) {
-        val += x_train[idx * n_train + jj];
-      }
-      xs_train[ii * n_train + jj] = val;
-    }
+  mtry = std::min(n_var, mtry);
+  if (max_leaf_nodes > 0) {
+    grow_best_first(features, z_basis, weights, n_var, n_basis,
+                    mtry, node_size, min_loss_delta, split_mode,
+                    n_thresholds, max_depth, max_leaf_nodes);
+  } else {
+    this -> root.train(features, z_basis, weights, this -> valid_idx.begin(),
+                       0, this -> valid_idx.size(), n_train, n_var, n_basis, mtry, node_size,
+                       min_loss_delta, split_mode, n_thresholds, max_depth);
+  }
+
+  // Keep the weights of the observations in the tree by position so
+  // that storage scales with the sample rather than n_train.
+  this -> wts.resize(this -> valid_idx.size());
+  for (size_t ii = 0; ii < this -> valid_idx.size(); ii++) {
+    this -> wts[ii] = weights[this -> valid_idx[ii]];
   }
+  index_leaves();
+}
 
-  // Determine starting index
-  auto start_it = this -> valid_idx.begin();
-  if (!fit_oob) {
-    // Remove observations with zero weight to avoid performance hit of
-    // sorting/summing over them.
-    sort_next(this -> valid_idx.begin(), this -> valid_idx.end(), weights.data());
-    for (; start_it != this -> valid_idx.end(); ++start_it) { if(weights[*start_it] > 0) { break; } }
+namespace {
+  struct Candidate {
+    Node* node;
+    Split split;
+    int depth;
+    int last_var;
 
-    if (start_it == this -> valid_idx.end()) {
-      start_it = this -> valid_idx.begin();
+    bool operator<(const Candidate& other) const {
+      return split.loss_delta < other.split.loss_delta;
     }
-  }
+  };
+}
+
+void Tree::grow_best_first(Features& features, const MatrixView& z_basis,
+                           const std::vector<int>& weights,
+                           int n_var, int n_basis, int mtry,
+                           int node_size, double min_loss_delta,
+                           int split_mode, int n_thresholds,
+                           int max_depth, int max_leaf_nodes) {
+  // Grows the tree by repeatedly splitting the leaf whose best split
+  // decreases the loss the most until max_leaf_nodes is reached.
+  //
+  // Leaves own disjoint ranges of valid_idx so each candidate keeps
+  // the variable its range is sorted by until it is split.
+  //
+  // Arguments: as for train.
+  //
+  // Side-Effects: builds the tree in root.
+  std::priority_queue<Candidate> candidates;
+  int n_leaves = 1;
 
-  this -> starts = starts;
-  this -> ends = ends;
+  auto push = [&](Node* node, int depth, int last_var) {
+    bool at_limit = n_leaves >= max_leaf_nodes ||
+      (max_depth > 0 && depth >= max_depth);
+    Split split = node -> evaluate(features, z_basis, weights,
+                                   this -> valid_idx.begin(), n_var, n_basis,
+                                   at_limit ? 0 : mtry, node_size,
+                                   min_loss_delta, split_mode, n_thresholds,
+                                   last_var);
+    if (split.var != -1) {
+      candidates.push(Candidate {node, split, depth, last_var});
+    }
+  };
 
-  mtry = std::min(n_var, mtry);
-  this -> root.train(xs_train, z_basis, weights, start_it,
-                     this -> valid_idx.end(),
-                     n_train, n_var, n_basis, mtry, node_size, min_loss_delta);
+  this -> root.valid_idx_begin = 0;
+  this -> root.valid_idx_end = this -> valid_idx.size();
+  push(&(this -> root), 0, -1);
 
-  free(xs_train);
+  while (!candidates.empty() && n_leaves < max_leaf_nodes) {
+    Candidate best = candidates.top();
+    candidates.pop();
 
+    best.node -> split(features, this -> valid_idx.begin(), best.split,
+                       split_mode, best.last_var);
+    n_leaves++;
+    push(best.node -> le_child, best.depth + 1, best.last_var);
+    push(best.node -> gt_child, best.depth + 1, best.last_var);
+  }
 }
 
-Node Tree::traverse(double* x_test) {
+const Node* Tree::traverse(const double* x_test,
+                           const double* prefix) const {
   // Traverses tree to determine id for leaf node.
   //
   // Arguments:
   //   x_test: pointer to a new observation
+  //   prefix: pointer to the prefix sums of x_test.
   //
   // Returns: the leaf node in which x_test ends up.
-  Node* cur = &(this -> root);
+  const Node* cur = &(this -> root);
   while (cur -> split_var != -1) {
-    if (calculate_feature(x_test, cur -> split_var) <= cur -> split_value) {
+    if (calculate_feature(x_test, prefix, cur -> split_var) <= cur -> split_value) {
       cur = cur -> le_child;
     } else {
       cur = cur -> gt_child;
     }
   }
-  return *cur;
+  return cur;
+}
+
+void Tree::index_leaves() {
+  // Numbers the leaves in pre-order and flattens the internal nodes.
+  //
+  // Side-Effects: sets leaf_id of every node and fills leaves and the
+  //   flat node arrays.
+  leaves.clear();
+  flat_var.clear();
+  flat_value.clear();
+  flat_le.clear();
+  flat_gt.clear();
+  if (root.is_leaf()) {
+    root.leaf_id = 0;
+    return;
+  }
+
+  // Entries are a node, the flat index of its parent and whether it
+  // is the parent's > child.
+  std::vector<std::pair<Node*, std::pair<int, bool> > > stack;
+  stack.push_back(std::make_pair(&root, std::make_pair(-1, false)));
+  while (!stack.empty()) {
+    Node* node = stack.back().first;
+    int parent = stack.back().second.first;
+    bool gt = stack.back().second.second;
+    stack.pop_back();
+
+    int id;
+    if (node -> is_leaf()) {
+      node -> leaf_id = leaves.size();
+      leaves.push_back(node);
+      id = ~(node -> leaf_id);
+    } else {
+      node -> leaf_id = -1;
+      id = flat_var.size();
+      flat_var.push_back(node -> split_var);
+      flat_value.push_back(node -> split_value);
+      flat_le.push_back(0);
+      flat_gt.push_back(0);
+      stack.push_back(std::make_pair(node -> gt_child, std::make_pair(id, true)));
+      stack.push_back(std::make_pair(node -> le_child, std::make_pair(id, false)));
+    }
+    if (parent >= 0) { (gt ? flat_gt : flat_le)[parent] = id; }
+  }
+}
+
+int Tree::max_weight() const {
+  // Largest weight of a single observation in the tree.
+  //
+  // Returns: a bound on the weight this tree adds to any entry of a
+  //   weight buffer, so that narrow integer buffers can be checked.
+  int largest = 0;
+  for (auto wt : wts) { largest = std::max(largest, wt); }
+
+  std::vector<const Node*> stack(1, &root);
+  while (!stack.empty()) {
+    const Node* node = stack.back();
+    stack.pop_back();
+    if (node -> is_leaf()) {
+      for (auto wt : node -> added_wts) { largest = std::max(largest, wt); }
+    } else {
+      stack.push_back(node -> le_child);
+      stack.push_back(node -> gt_child);
+    }
+  }
+  return largest;
+}
+
+void Tree::add_observation(double* x_new, const double* prefix,
+                           const MatrixView& z_basis, int n_basis,
+                           int idx, int weight) {
+  // Adds a new observation to the leaf node containing it.
+  //
+  // The tree structure is unchanged; the leaf keeps the observation
+  // and its weight alongside its training observations and updates
+  // its basis sums.
+  //
+  // Arguments:
+  //   x_new: pointer to the covariates of the observation.
+  //   prefix: pointer to the prefix sums of x_new.
+  //   z_basis: view of basis function evaluations of all
+  //     observations.
+  //   n_basis: number of basis functions.
+  //   idx: index of the observation.
+  //   weight: bootstrap weight of the observation.
+  //
+  // Side-Effects: appends the observation to the leaf node.
+  // The tree is not const here so the leaf may be modified.
+  Node* leaf = const_cast<Node*>(traverse(x_new, prefix));
+  leaf -> added_idx.push_back(idx);
+  leaf -> added_wts.push_back(weight);
+  if (weight == 0) { return; }
+
+  std::vector<double> z_row(n_basis);
+  z_basis.row(idx, n_basis, z_row.data());
+  leaf -> basis_sum.resize(n_basis, 0.0);
+  for (int bb = 0; bb < n_basis; bb++) {
+    leaf -> basis_sum[bb] += z_row[bb] * weight;
+  }
+  leaf -> weight += weight;
+}
+
+void Tree::save(std::ostream& out) const {
+  // Writes the tree in binary form for load.
+  write_value(out, n_train);
+  write_vector(out, valid_idx);
+  write_vector(out, wts);
+  write_vector(out, starts);
+  write_vector(out, ends);
+  write_vector(out, prefix_lo);
+  root.save(out);
+}
+
+void Tree::load(std::istream& in, int n_train, int n_var, int n_prefix,
+                int n_basis) {
+  // Reads a tree written by save.
+  //
+  // Every index is checked against the forest so that a corrupt or
+  // mismatched stream cannot make prediction read out of bounds.
+  //
+  // Arguments:
+  //   in: stream to read from.
+  //   n_train: number of training observations of the forest.
+  //   n_var: number of covariates.
+  //   n_prefix: number of prefix columns of the forest.
+  //   n_basis: number of basis functions.
+  read_value(in, this -> n_train);
+  read_vector(in, valid_idx);
+  read_vector(in, wts);
+  read_vector(in, starts);
+  read_vector(in, ends);
+  read_vector(in, prefix_lo);
+  if (this -> n_train != n_train || wts.size() != valid_idx.size() ||
+      ends.size() != starts.size() || prefix_lo.size() != starts.size()) {
+    throw std::invalid_argument("Corrupt serialized tree");
+  }
+  for (auto &idx : valid_idx) {
+    if (idx < 0 || idx >= n_train) {
+      throw std::invalid_argument("Corrupt serialized tree");
+    }
+  }
+  for (size_t bb = 0; bb < starts.size(); bb++) {
+    bool bad_block = starts[bb] < 0 || ends[bb] <= starts[bb] ||
+      ends[bb] > n_var;
+    bool bad_prefix = prefix_lo[bb] < -1 ||
+      (prefix_lo[bb] >= 0 && prefix_lo[bb] + ends[bb] - starts[bb] >= n_prefix);
+    if (bad_block || bad_prefix) {
+      throw std::invalid_argument("Corrupt serialized tree");
+    }
+  }
+  root.load(in, starts.size(), valid_idx.size(), n_train, n_basis);
+  index_leaves();
 }
@@ -4,56 +4,144 @@
 #ifndef TREE_GUARD
 #define TREE_GUARD
 #include <vector>
+#include <random>
+#include <istream>
+#include <ostream>
 #include "Node.h"
+#include "Features.h"
 
 class Tree {
  public:
   Node root;
   int n_train;
-  std::vector<int> valid_idx;
-  std::vector<int> wts;
+  std::vector<int> valid_idx; // observations in the tree.
+  std::vector<int> wts; // weight of each observation in valid_idx.
   std::vector<int> starts;
   std::vector<int> ends;
+  std::vector<int> prefix_lo; // prefix column preceding each block; -1 for singletons.
+  // Leaves by leaf_id; empty when the root is the only leaf since
+  // the root moves with the tree while other nodes stay in place.
+  std::vector<const Node*> leaves;
+  // Internal nodes in pre-order as flat arrays for lockstep
+  // traversal; children are indices of internal nodes or ~leaf_id for
+  // leaves. Empty when the root is the only leaf.
+  std::vector<int> flat_var;
+  std::vector<double> flat_value;
+  std::vector<int> flat_le;
+  std::vector<int> flat_gt;
 
-  void train(double* x_train, double* z_basis, int* lens, const std::vector<int>& weights,
-             int n_train, int n_var, int n_basis, int mtry, int node_size,
-             double min_loss_delta, double flambda, bool fit_oob);
-  Node traverse(double* x_test);
+  void train(const Partition& partition, Features& features,
+             const MatrixView& z_basis, const std::vector<int>& weights,
+             const std::vector<int>& sample_idx,
+             int n_train, int n_basis, int mtry, int node_size,
+             double min_loss_delta, int split_mode, int n_thresholds,
+             int max_depth, int max_leaf_nodes,
+             std::default_random_engine& rng);
+  void grow_best_first(Features& features, const MatrixView& z_basis,
+                       const std::vector<int>& weights,
+                       int n_var, int n_basis, int mtry,
+                       int node_size, double min_loss_delta,
+                       int split_mode, int n_thresholds,
+                       int max_depth, int max_leaf_nodes);
+  const Node* traverse(const double* x_test, const double* prefix) const;
+  void index_leaves();
+  int max_weight() const;
 
-  double calculate_feature(double* x_test, int idx) {
-    double val = 0.0;
-    for (int ii = this -> starts[idx]; ii < this -> ends[idx]; ++ii) {
-      val += x_test[ii];
-    }
-    return val;
+  int n_leaves() const {
+    return leaves.empty() ? 1 : leaves.size();
   }
 
-  // Use template since Python uses longs and R uses ints for their
-  // integer types.
+  const Node* leaf(int leaf_id) const {
+    return leaves.empty() ? &root : leaves[leaf_id];
+  }
+  void save(std::ostream& out) const;
+  void load(std::istream& in, int n_train, int n_var, int n_prefix,
+            int n_basis);
+  void add_observation(double* x_new, const double* prefix,
+                       const MatrixView& z_basis, int n_basis,
+                       int idx, int weight);
+
+  double calculate_feature(const double* x_test, const double* prefix,
+                           int idx) const {
+    // Singleton blocks are the covariate itself; other blocks are a
+    // difference of prefix sums, matching the training aggregation.
+    int lo = this -> prefix_lo[idx];
+    if (lo < 0) { return x_test[this -> starts[idx]]; }
+    return prefix[lo + this -> ends[idx] - this -> starts[idx]] - prefix[lo];
+  }
+
+  // Use template since Python uses narrow unsigned integers, longs
+  // or floats and R uses ints for their weights.
   template<class INTEGER>
-  void update_weights(double* x_test, INTEGER* wt_buf) {
+  void update_weights(const double* x_test, const double* prefix,
+                      INTEGER* wt_buf) const {
     // Update weights for prediction on new variable.
     //
     // Arguments:
     //   x_test: pointer to test data.
+    //   prefix: pointer to the prefix sums of x_test.
     //   wt_buf: pointer to weights array.
     //
     // Side-Effects: increments the values wt_buf by the prediction
     //   weight derived from this tree.
-    Node id = traverse(x_test);
-    for(auto it = id.valid_idx_begin; it != id.valid_idx_end; ++it) {
-      wt_buf[*it] += wts[*it];
+    update_leaf_weights(traverse(x_test, prefix), wt_buf);
+  };
+
+  template<class INTEGER>
+  void update_leaf_weights(const Node* id, INTEGER* wt_buf) const {
+    // Increments wt_buf by the weights of the members of a leaf.
+    for (int ii = id -> valid_idx_begin; ii < id -> valid_idx_end; ii++) {
+      wt_buf[valid_idx[ii]] += wts[ii];
+    }
+    for (size_t ii = 0; ii < id -> added_idx.size(); ii++) {
+      wt_buf[id -> added_idx[ii]] += id -> added_wts[ii];
     }
   };
 
+  void update_series(const double* x_test, const double* prefix,
+                     double* basis_sum, double& weight) const {
+    // Update series coefficients for prediction on new variable.
+    //
+    // Arguments:
+    //   x_test: pointer to test data.
+    //   prefix: pointer to the prefix sums of x_test.
+    //   basis_sum: pointer to weighted basis sums.
+    //   weight: total weight.
+    //
+    // Side-Effects: increments basis_sum and weight by the sums of
+    //   the leaf node containing x_test.
+    update_leaf_series(traverse(x_test, prefix), basis_sum, weight);
+  };
+
+  void update_leaf_series(const Node* id, double* basis_sum,
+                          double& weight) const {
+    // Increments basis_sum and weight by the sums of a leaf.
+    for (size_t bb = 0; bb < id -> basis_sum.size(); bb++) {
+      basis_sum[bb] += id -> basis_sum[bb];
+    }
+    weight += id -> weight;
+  };
+
   template<class INTEGER>
-  void update_oob_weights_helper(INTEGER* wt_mat, Node* node) {
+  void update_oob_weights_helper(INTEGER* wt_mat, const Node* node) const {
     if (node -> is_leaf()) {
-      int n_train = wts.size();
-      for(auto lt = node -> valid_idx_begin; lt != node -> valid_idx_end; ++lt) {
-        for(auto rt = node -> valid_idx_begin; rt != lt; ++rt) {
-          if (wts[*rt] == 0) { wt_mat[*lt * n_train + *rt] += wts[*lt]; }
-          if (wts[*lt] == 0) { wt_mat[*rt * n_train + *lt] += wts[*rt]; }
+      // Members of the leaf are its range of valid_idx followed by
+      // any observations added after training.
+      std::vector<int> idx(valid_idx.begin() + node -> valid_idx_begin,
+                           valid_idx.begin() + node -> valid_idx_end);
+      std::vector<int> wt(wts.begin() + node -> valid_idx_begin,
+                          wts.begin() + node -> valid_idx_end);
+      idx.insert(idx.end(), node -> added_idx.begin(), node -> added_idx.end());
+      wt.insert(wt.end(), node -> added_wts.begin(), node -> added_wts.end());
+
+      for (size_t lt = 0; lt < idx.size(); lt++) {
+        for (size_t rt = 0; rt < lt; rt++) {
+          if (wt[rt] == 0) {
+            wt_mat[idx[lt] * n_train + idx[rt]] += wt[lt];
+          }
+          if (wt[lt] == 0) {
+            wt_mat[idx[rt] * n_train + idx[lt]] += wt[rt];
+          }
         }
       }
     } else {
@@ -65,14 +153,15 @@ class Tree {
   // Use template since Python uses longs and R uses ints for their
   // integer types.
   template<class INTEGER>
-  void update_oob_weights(INTEGER* wt_mat) {
+  void update_oob_weights(INTEGER* wt_mat) const {
     // Traverse the tree filling in pairwise weights for each leaf
     // node.
     update_oob_weights_helper(wt_mat, &(this -> root));
   };
 
 
-  void update_loss_importance(double* scores, Node* current = NULL) {
+  void update_loss_importance(double* scores,
+                              const Node* current = NULL) const {
     // Update variable importance counts
     //
     // Traverse down the tree and decreased loss for the selected
@@ -102,7 +191,8 @@ class Tree {
     }
   };
 
-  void update_count_importance(double* scores, Node* current = NULL) {
+  void update_count_importance(double* scores,
+                               const Node* current = NULL) const {
     // Update variable importance counts
     //
     // Traverse down the tree and increment for each time a variable
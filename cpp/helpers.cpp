@@ -9,6 +9,61 @@ void sortby(ivecit begin, ivecit end, const double* x) {
   std::sort(begin, end, SortComparator(x));
 }
 
-void sort_next(ivecit begin, ivecit end, const int* w) {
-  std::sort(begin, end, IntComparator(w));
+void sortby(ivecit begin, ivecit end, const uint32_t* ranks, int n_bits,
+            std::vector<int>& buffer) {
+  // Sorts indices by integer ranks using LSD radix sort.
+  //
+  // Uses 8 bit digits so the number of passes is determined by the
+  // largest rank; passes in which every rank shares a digit are
+  // skipped. Small ranges fall back to a comparison sort.
+  //
+  // Arguments:
+  //   begin, end: range of indices to sort.
+  //   ranks: pointer to ranks of each index.
+  //   n_bits: number of bits needed for the largest rank.
+  //   buffer: scratch space; resized as needed.
+  int n_idx = end - begin;
+  if (n_idx < 64) {
+    std::sort(begin, end, RankComparator(ranks));
+    return;
+  }
+
+  if (static_cast<int>(buffer.size()) < n_idx) { buffer.resize(n_idx); }
+  int* src = &(*begin);
+  int* dst = buffer.data();
+
+  for (int shift = 0; shift < n_bits; shift += 8) {
+    int counts[257] = {0};
+    for (int ii = 0; ii < n_idx; ii++) {
+      counts[((ranks[src[ii]] >> shift) & 0xFF) + 1]++;
+    }
+    if (counts[((ranks[src[0]] >> shift) & 0xFF) + 1] == n_idx) { continue; }
+
+    for (int dd = 0; dd < 256; dd++) { counts[dd + 1] += counts[dd]; }
+    for (int ii = 0; ii < n_idx; ii++) {
+      dst[counts[(ranks[src[ii]] >> shift) & 0xFF]++] = src[ii];
+    }
+    std::swap(src, dst);
+  }
+
+  if (src != &(*begin)) {
+    std::copy(src, src + n_idx, begin);
+  }
+}
+
+uint64_t hash_values(uint64_t hash, const double* values, int n_values) {
+  // Continues an FNV-1a hash over the bytes of an array of values.
+  //
+  // Arguments:
+  //   hash: hash of the preceding data.
+  //   values: pointer to the values.
+  //   n_values: number of values.
+  //
+  // Returns: the updated hash.
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(values);
+  for (size_t bb = 0; bb < n_values * sizeof(double); bb++) {
+    hash ^= bytes[bb];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
 }
@@ -4,6 +4,7 @@
 #ifndef HELPER_GUARD
 #define HELPER_GUARD
 
+#include <stdint.h>
 #include <vector>
 #include <algorithm>
 
@@ -17,13 +18,15 @@ struct SortComparator {
 
 void sortby(ivecit begin, ivecit end, const double* x);
 
-
-struct IntComparator {
-  const int* w;
-  IntComparator(const int* w) { this -> w = w; }
-  bool operator()(int li, int ri) { return w[li] < w[ri]; }
+struct RankComparator {
+  const uint32_t* r;
+  RankComparator(const uint32_t* r) { this -> r = r; }
+  bool operator()(int li, int ri) { return r[li] < r[ri]; }
 };
 
-void sort_next(ivecit begin, ivecit end, const int* w);
+void sortby(ivecit begin, ivecit end, const uint32_t* ranks, int n_bits,
+            std::vector<int>& buffer);
+
+uint64_t hash_values(uint64_t hash, const double* values, int n_values);
 
 #endif
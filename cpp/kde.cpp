@@ -0,0 +1,252 @@
+// Copyright Taylor Pospisil 2018.
+// Distributed under MIT License (http://opensource.org/licenses/MIT)
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "kde.h"
+
+namespace {
+  const double pi = 3.14159265358979323846;
+  const int n_bins = 401;
+
+  double weighted_quantile(std::vector<std::pair<double, double> >& vals,
+                           double total_weight, double quantile) {
+    // Weighted quantile of (value, weight) pairs sorted by value.
+    double target = quantile * total_weight;
+    double cum_weight = 0.0;
+    for (auto it = vals.begin(); it != vals.end(); ++it) {
+      cum_weight += it -> second;
+      if (cum_weight >= target) { return it -> first; }
+    }
+    return vals.back().first;
+  }
+
+  double binned_psi(const std::vector<double>& autocorr, double delta,
+                    int order, double g) {
+    // Binned estimate of the density functional \psi_{r} =
+    // \sum_{i,j} p_i p_j \phi_{g}^{(r)}(z_i - z_j) for r = 4 or 6.
+    double psi = 0.0;
+    for (int mm = 0; mm < n_bins; mm++) {
+      double u = mm * delta / g;
+      double u2 = u * u;
+      double hermite;
+      if (order == 4) {
+        hermite = (u2 - 6.0) * u2 + 3.0;
+      } else {
+        hermite = ((u2 - 15.0) * u2 + 45.0) * u2 - 15.0;
+      }
+      psi += autocorr[mm] * hermite * std::exp(-u2 / 2.0);
+    }
+    return psi / (std::sqrt(2.0 * pi) * std::pow(g, order + 1));
+  }
+
+  double plugin_bandwidth(const double* z, const std::vector<int>& idx,
+                          const std::vector<double>& wts, double total_weight,
+                          double z_min, double z_max, double scale,
+                          double n_eff) {
+    // Two-stage direct plug-in bandwidth (Wand & Jones, 1995) using
+    // linear binning of the weighted responses.
+    double delta = (z_max - z_min) / (n_bins - 1);
+    std::vector<double> counts(n_bins, 0.0);
+    for (size_t kk = 0; kk < idx.size(); kk++) {
+      double pos = (z[idx[kk]] - z_min) / delta;
+      int lo = std::min(static_cast<int>(pos), n_bins - 2);
+      double frac = pos - lo;
+      counts[lo] += wts[kk] / total_weight * (1.0 - frac);
+      counts[lo + 1] += wts[kk] / total_weight * frac;
+    }
+
+    // autocorr[m] = \sum_{k, l : |k - l| = m} c_k c_l
+    std::vector<double> autocorr(n_bins, 0.0);
+    for (int kk = 0; kk < n_bins; kk++) {
+      if (counts[kk] == 0.0) { continue; }
+      autocorr[0] += counts[kk] * counts[kk];
+      for (int ll = kk + 1; ll < n_bins; ll++) {
+        autocorr[ll - kk] += 2.0 * counts[kk] * counts[ll];
+      }
+    }
+
+    double psi8 = 105.0 / (32.0 * std::sqrt(pi) * std::pow(scale, 9));
+    double g1 = std::pow(30.0 / (std::sqrt(2.0 * pi) * psi8 * n_eff), 1.0 / 9.0);
+    double psi6 = binned_psi(autocorr, delta, 6, g1);
+    double g2 = std::pow(-6.0 / (std::sqrt(2.0 * pi) * psi6 * n_eff), 1.0 / 7.0);
+    double psi4 = binned_psi(autocorr, delta, 4, g2);
+    return std::pow(1.0 / (2.0 * std::sqrt(pi) * psi4 * n_eff), 1.0 / 5.0);
+  }
+}
+
+void select_bandwidth_sparse(const double* z_train, int n_train, int n_dim,
+                             const std::vector<int>& idx,
+                             const std::vector<double>& wts,
+                             int rule, double* bandwidth) {
+  // Selects a bandwidth for each response dimension from sparse
+  // (index, weight) pairs.
+  //
+  // The sample size in each rule is the effective sample size
+  // (\sum w)^2 / \sum w^2 and the scale is min(sd, IQR / 1.349) as in
+  // statsmodels. Univariate rules follow the statsmodels constants;
+  // multivariate rules apply the normal reference rules to each
+  // dimension. The plug-in rule is applied to each dimension
+  // separately, giving a diagonal bandwidth matrix.
+  //
+  // Arguments:
+  //   z_train: pointer to training responses (column-major).
+  //   n_train: number of training observations.
+  //   n_dim: dimension of the responses.
+  //   idx: training indices with nonzero weight.
+  //   wts: weights corresponding to idx.
+  //   rule: a BandwidthRule.
+  //   bandwidth: pointer to output buffer of length n_dim.
+  //
+  // Side-Effects: fills bandwidth; zero for constant responses.
+  double total_weight = 0.0;
+  double total_sq_weight = 0.0;
+  for (size_t kk = 0; kk < wts.size(); kk++) {
+    total_weight += wts[kk];
+    total_sq_weight += wts[kk] * wts[kk];
+  }
+
+  std::vector<std::pair<double, double> > vals(idx.size());
+  for (int dd = 0; dd < n_dim; dd++) {
+    bandwidth[dd] = 0.0;
+    if (idx.size() < 2) { continue; }
+
+    const double* z = &z_train[dd * n_train];
+    double n_eff = total_weight * total_weight / total_sq_weight;
+
+    double mean = 0.0;
+    for (size_t kk = 0; kk < idx.size(); kk++) {
+      mean += wts[kk] * z[idx[kk]];
+    }
+    mean /= total_weight;
+
+    double var = 0.0;
+    for (size_t kk = 0; kk < idx.size(); kk++) {
+      var += wts[kk] * (z[idx[kk]] - mean) * (z[idx[kk]] - mean);
+    }
+    double sd = std::sqrt(var / total_weight);
+
+    for (size_t kk = 0; kk < idx.size(); kk++) {
+      vals[kk] = std::make_pair(z[idx[kk]], wts[kk]);
+    }
+    std::sort(vals.begin(), vals.end());
+    double iqr = weighted_quantile(vals, total_weight, 0.75) -
+      weighted_quantile(vals, total_weight, 0.25);
+    double scale = std::min(sd, iqr / 1.349);
+    if (scale <= 0.0) { scale = sd; }
+    if (scale <= 0.0) { continue; }
+
+    if (rule == PLUGIN_RULE) {
+      bandwidth[dd] = plugin_bandwidth(z, idx, wts, total_weight,
+                                       vals.front().first, vals.back().first,
+                                       scale, n_eff);
+    } else if (n_dim == 1) {
+      double factor = (rule == SILVERMAN_RULE) ? 0.9 : 1.059;
+      bandwidth[dd] = factor * scale * std::pow(n_eff, -0.2);
+    } else {
+      double factor = (rule == SILVERMAN_RULE) ?
+        std::pow(4.0 / (n_dim + 2.0), 1.0 / (n_dim + 4.0)) : 1.0;
+      bandwidth[dd] = factor * scale * std::pow(n_eff, -1.0 / (n_dim + 4.0));
+    }
+  }
+}
+
+int kde_loss_curve_sparse(const double* z_train, const double* z_test,
+                          const std::vector<int>& row_ptr,
+                          const std::vector<int>& idx,
+                          const std::vector<double>& wts,
+                          int n_train, int n_test, int n_dim,
+                          const double* bandwidths, int n_bandwidths,
+                          double* losses) {
+  // Calculates the Gaussian KDE CDE loss for each candidate bandwidth.
+  //
+  // For normalized weights p_i and bandwidth h the loss for a single
+  // test point z is
+  //   \int f^2 - 2 f(z) = \sum_{i,j} p_i p_j N(z_i - z_j; 0, 2h^2)
+  //                       - 2 \sum_{i} p_i N(z - z_i; 0, h^2).
+  // The squared distances only depend on the weights so they are
+  // computed once per pair and shared across all bandwidths.
+  //
+  // Arguments:
+  //   z_train: pointer to training responses (column-major).
+  //   z_test: pointer to test responses (column-major).
+  //   row_ptr: offsets of each test point's entries in idx/wts.
+  //   idx: training indices with nonzero weight.
+  //   wts: weights corresponding to idx.
+  //   n_train: number of training observations.
+  //   n_test: number of test observations.
+  //   n_dim: dimension of the responses.
+  //   bandwidths: pointer to candidate bandwidths.
+  //   n_bandwidths: number of candidate bandwidths.
+  //   losses: pointer to output buffer of length n_bandwidths.
+  //
+  // Returns: the index of the bandwidth with the smallest loss.
+
+  std::vector<double> pair_scale(n_bandwidths);
+  std::vector<double> test_scale(n_bandwidths);
+  std::vector<double> pair_norm(n_bandwidths);
+  std::vector<double> test_norm(n_bandwidths);
+  for (int bb = 0; bb < n_bandwidths; bb++) {
+    double h2 = bandwidths[bb] * bandwidths[bb];
+    double hd = std::pow(bandwidths[bb], n_dim);
+    pair_scale[bb] = 1.0 / (4.0 * h2);
+    test_scale[bb] = 1.0 / (2.0 * h2);
+    pair_norm[bb] = 1.0 / (std::pow(4.0 * pi, n_dim / 2.0) * hd);
+    test_norm[bb] = 1.0 / (std::pow(2.0 * pi, n_dim / 2.0) * hd);
+    losses[bb] = 0.0;
+  }
+
+  std::vector<double> term1(n_bandwidths);
+  std::vector<double> term2(n_bandwidths);
+  for (int ii = 0; ii < n_test; ii++) {
+    double total_weight = 0.0;
+    for (int kk = row_ptr[ii]; kk < row_ptr[ii + 1]; kk++) {
+      total_weight += wts[kk];
+    }
+    // Rows without weight contribute zero loss.
+    if (total_weight <= 0.0) { continue; }
+
+    std::fill(term1.begin(), term1.end(), 0.0);
+    std::fill(term2.begin(), term2.end(), 0.0);
+    for (int kk = row_ptr[ii]; kk < row_ptr[ii + 1]; kk++) {
+      double pk = wts[kk] / total_weight;
+
+      // Diagonal of the pairwise sum has zero distance.
+      for (int bb = 0; bb < n_bandwidths; bb++) { term1[bb] += pk * pk; }
+
+      for (int ll = row_ptr[ii]; ll < kk; ll++) {
+        double dist = 0.0;
+        for (int dd = 0; dd < n_dim; dd++) {
+          double delta = z_train[dd * n_train + idx[kk]] -
+            z_train[dd * n_train + idx[ll]];
+          dist += delta * delta;
+        }
+        double pkl = 2.0 * pk * wts[ll] / total_weight;
+        for (int bb = 0; bb < n_bandwidths; bb++) {
+          term1[bb] += pkl * std::exp(-dist * pair_scale[bb]);
+        }
+      }
+
+      double dist = 0.0;
+      for (int dd = 0; dd < n_dim; dd++) {
+        double delta = z_test[dd * n_test + ii] - z_train[dd * n_train + idx[kk]];
+        dist += delta * delta;
+      }
+      for (int bb = 0; bb < n_bandwidths; bb++) {
+        term2[bb] += pk * std::exp(-dist * test_scale[bb]);
+      }
+    }
+
+    for (int bb = 0; bb < n_bandwidths; bb++) {
+      losses[bb] += term1[bb] * pair_norm[bb] - 2.0 * term2[bb] * test_norm[bb];
+    }
+  }
+
+  int best = 0;
+  for (int bb = 0; bb < n_bandwidths; bb++) {
+    losses[bb] /= n_test;
+    if (losses[bb] < losses[best]) { best = bb; }
+  }
+  return best;
+}
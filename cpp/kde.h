@@ -0,0 +1,105 @@
+// Copyright Taylor Pospisil 2018.
+// Distributed under MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef KDE_GUARD
+#define KDE_GUARD
+#include <vector>
+
+// Rules for selecting bandwidths from weighted responses.
+enum BandwidthRule { PLUGIN_RULE = 0, SILVERMAN_RULE = 1, SCOTT_RULE = 2 };
+
+void select_bandwidth_sparse(const double* z_train, int n_train, int n_dim,
+                             const std::vector<int>& idx,
+                             const std::vector<double>& wts,
+                             int rule, double* bandwidth);
+
+template<class WEIGHT>
+void select_bandwidth(const double* z_train, const WEIGHT* weights,
+                      int n_train, int n_dim, int rule, double* bandwidth) {
+  // Selects a bandwidth for each response dimension from weighted
+  // training responses without replicating rows by weight.
+  //
+  // Arguments:
+  //   z_train: pointer to training responses (column-major).
+  //   weights: pointer to weights of the training points.
+  //   n_train: number of training observations.
+  //   n_dim: dimension of the responses.
+  //   rule: a BandwidthRule.
+  //   bandwidth: pointer to output buffer of length n_dim.
+  //
+  // Side-Effects: fills bandwidth with the standard deviation of the
+  //   Gaussian kernel in each dimension.
+  std::vector<int> idx;
+  std::vector<double> wts;
+  for (int ii = 0; ii < n_train; ii++) {
+    if (weights[ii] > 0) {
+      idx.push_back(ii);
+      wts.push_back(weights[ii]);
+    }
+  }
+  select_bandwidth_sparse(z_train, n_train, n_dim, idx, wts, rule, bandwidth);
+}
+
+int kde_loss_curve_sparse(const double* z_train, const double* z_test,
+                          const std::vector<int>& row_ptr,
+                          const std::vector<int>& idx,
+                          const std::vector<double>& wts,
+                          int n_train, int n_test, int n_dim,
+                          const double* bandwidths, int n_bandwidths,
+                          double* losses);
+
+// Use template since Python uses longs and R uses ints/doubles for
+// their weight matrices.
+template<class WEIGHT>
+int kde_loss_curve(const double* z_train, const double* z_test,
+                   const WEIGHT* wt_mat, int n_train, int n_test, int n_dim,
+                   const double* bandwidths, int n_bandwidths,
+                   double* losses) {
+  // Calculates the KDE CDE loss for a vector of candidate bandwidths.
+  //
+  // Arguments:
+  //   z_train: pointer to training responses (column-major).
+  //   z_test: pointer to test responses (column-major).
+  //   wt_mat: pointer to the weight matrix (column-major); element
+  //     [ii, jj] is the weight of training point jj for test point ii.
+  //   n_train: number of training observations.
+  //   n_test: number of test observations.
+  //   n_dim: dimension of the responses.
+  //   bandwidths: pointer to candidate bandwidths.
+  //   n_bandwidths: number of candidate bandwidths.
+  //   losses: pointer to output buffer of length n_bandwidths.
+  //
+  // Returns: the index of the bandwidth with the smallest loss.
+  //
+  // Side-Effects: fills losses with the average loss over test points.
+
+  // Compress the weight matrix into sparse rows in a single
+  // column-major pass.
+  std::vector<int> row_ptr(n_test + 1, 0);
+  for (int jj = 0; jj < n_train; jj++) {
+    for (int ii = 0; ii < n_test; ii++) {
+      if (wt_mat[jj * n_test + ii] != 0) { row_ptr[ii + 1]++; }
+    }
+  }
+  for (int ii = 0; ii < n_test; ii++) { row_ptr[ii + 1] += row_ptr[ii]; }
+
+  std::vector<int> cursor(row_ptr.begin(), row_ptr.end() - 1);
+  std::vector<int> idx(row_ptr[n_test]);
+  std::vector<double> wts(row_ptr[n_test]);
+  for (int jj = 0; jj < n_train; jj++) {
+    for (int ii = 0; ii < n_test; ii++) {
+      WEIGHT w = wt_mat[jj * n_test + ii];
+      if (w != 0) {
+        idx[cursor[ii]] = jj;
+        wts[cursor[ii]] = w;
+        cursor[ii]++;
+      }
+    }
+  }
+
+  return kde_loss_curve_sparse(z_train, z_test, row_ptr, idx, wts,
+                               n_train, n_test, n_dim,
+                               bandwidths, n_bandwidths, losses);
+}
+
+#endif
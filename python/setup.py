@@ -12,9 +12,13 @@ ext_modules = cythonize([
               sources=[
                   'src/rfcde/ForestWrapper.pyx', 'src/rfcde/Forest.cpp',
                   'src/rfcde/Tree.cpp', 'src/rfcde/Node.cpp',
-                  'src/rfcde/Split.cpp', 'src/rfcde/helpers.cpp'
+                  'src/rfcde/Split.cpp', 'src/rfcde/helpers.cpp',
+                  'src/rfcde/Features.cpp', 'src/rfcde/kde.cpp',
+                  'src/rfcde/Scorer.cpp', 'src/rfcde/Lockstep.cpp',
+                  'src/rfcde/Codegen.cpp'
               ],
-              extra_compile_args=['-std=c++11'],
+              extra_compile_args=['-std=c++11', '-pthread'],
+              extra_link_args=['-pthread'],
               include_dirs=[np.get_include(), "src/rfcde/"],
               language='c++')
 ])
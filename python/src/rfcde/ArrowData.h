@@ -0,0 +1 @@
+../../../cpp/ArrowData.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../cpp/Codegen.h
\ No newline at end of file
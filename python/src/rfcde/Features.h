@@ -0,0 +1 @@
+../../../cpp/Features.h
\ No newline at end of file
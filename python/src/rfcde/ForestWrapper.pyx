@@ -3,27 +3,232 @@
 
 cimport cython
 from libcpp cimport bool
+from libcpp.string cimport string
+from libcpp.vector cimport vector
+from libc.stdint cimport int64_t, uint16_t, uint32_t, uint64_t, uintptr_t
 
 import numpy as np
 cimport numpy as np
 
+cdef extern from "Matrix.h":
+    cdef enum DataType:
+        FLOAT64
+        FLOAT32
+
+    cdef cppclass MatrixView:
+        MatrixView()
+        MatrixView(const void* data, ptrdiff_t row_stride,
+                   ptrdiff_t col_stride, int dtype)
+        void column(int col, int n_rows, double* out)
+        void row(int row, int n_cols, double* out)
+
+cdef extern from "ArrowData.h":
+    cdef struct ArrowSchema:
+        const char* format
+        long long n_children
+        void (*release)(ArrowSchema*)
+
+    cdef struct ArrowArray:
+        long long length
+        long long n_children
+        void (*release)(ArrowArray*)
+
+    MatrixView arrow_view(const ArrowSchema* schema, const ArrowArray* array,
+                          vector[const void*]& columns) except +
+
+cdef extern from "Scorer.h":
+    cdef cppclass BitvectorScorer:
+        BitvectorScorer() except +
+        void build(const Forest& forest) except +
+
 cdef extern from "Forest.h":
     cdef cppclass Forest:
         Forest() except +
 
+        int n_train
+
         # Methods
-        void train(double* x_train, double* z_basis,
+        void train(const MatrixView& x_train, const MatrixView& z_basis,
                    int* lens, int n_train, int n_var, int n_basis, int n_trees, int mtry,
                    int node_size, double min_loss_delta, double flambda,
-                   bool fit_oob)
-        void fill_weights(double* x_test, long* wt_buf);
-        void fill_oob_weights(long* wt_mat);
-        void fill_loss_importance(double* imp);
-        void fill_count_importance(double* imp);
+                   bool fit_oob, int split_mode, int n_thresholds,
+                   double sample_fraction, int n_partitions, int max_depth,
+                   int max_leaf_nodes, double max_time, int seed,
+                   int n_workers) nogil except +
+        int add_trees(int n_trees, double max_time) nogil except +
+        void add_observations(const MatrixView& x_train,
+                              const MatrixView& z_basis, int n_train) nogil except +
+        void merge(Forest& other) except +
+        string serialize()
+        void deserialize(const string& data) except +
+        int n_trees()
+        int64_t max_weight()
+        void fill_weights[INTEGER](double* x_test, INTEGER* wt_buf) nogil
+        void fill_normalized_weights[REAL](double* x_test, REAL* wt_buf) nogil
+        void fill_oob_weights[INTEGER](INTEGER* wt_mat) nogil
+        void fill_series_coefs(double* x_test, double* coefs) nogil
+        void predict_series_cde(double* x_test, double* grid_basis,
+                                int n_grid, double* cde) nogil
+        void apply(const MatrixView& x_test, int n_test, int* leaf_ids,
+                   int n_threads, const BitvectorScorer* scorer) nogil except +
+        bool valid_leaf_ids(int* leaf_ids, int n_rows)
+        void fill_leaf_weights[INTEGER](int* leaf_row, INTEGER* wt_buf) nogil
+        void predict_leaf_series_cde(int* leaf_row, double* grid_basis,
+                                     int n_grid, double* cde) nogil
+        void fill_loss_importance(double* imp) nogil
+        void fill_count_importance(double* imp) nogil
+
+cdef extern from "Codegen.h":
+    uint64_t structure_hash(const Forest& forest)
+    string generate_source(const Forest& forest) except +
+
+cdef extern from "kde.h":
+    void select_bandwidth[WEIGHT](double* z_train, WEIGHT* weights,
+                                  int n_train, int n_dim, int rule,
+                                  double* bandwidth) nogil
+    int kde_loss_curve[WEIGHT](double* z_train, double* z_test, WEIGHT* wt_mat,
+                               int n_train, int n_test, int n_dim,
+                               double* bandwidths, int n_bandwidths,
+                               double* losses) nogil
+
+SPLIT_MODES = {"best": 0, "random": 1}
+ENGINES = ("traverse", "bitvector")
+
+# Element types of weight buffers.
+ctypedef fused weight_t:
+    uint16_t
+    uint32_t
+    long
+    float
+
+
+cdef MatrixView matrix_view(np.ndarray x) except *:
+    """Views a 2-d float32 or float64 array of any layout without copying."""
+    cdef int dtype
+    if x.dtype == np.float64:
+        dtype = FLOAT64
+    elif x.dtype == np.float32:
+        dtype = FLOAT32
+    else:
+        raise ValueError("Training arrays must be float32 or float64")
+    if x.strides[0] % x.itemsize or x.strides[1] % x.itemsize:
+        raise ValueError("Array strides must be multiples of the item size")
+    return MatrixView(np.PyArray_DATA(x), x.strides[0] // x.itemsize,
+                      x.strides[1] // x.itemsize, dtype)
+
+
+def append_rows(buffer, int n_rows, rows, order="C"):
+    """Appends rows below the first n_rows rows of a buffer.
+
+    The buffer is reallocated with twice the rows when full, so that
+    appending is amortized linear in the number of new rows. Pass
+    None to start a buffer.
+
+    Returns
+    -------
+    numpy matrix
+        The buffer holding the rows; may be a new array.
+    """
+    rows = np.asarray(rows)
+    cdef int n_total = n_rows + rows.shape[0]
+    if buffer is None or n_total > buffer.shape[0]:
+        shape = (max(n_total, 2 * n_rows),) + rows.shape[1:]
+        dtype = rows.dtype if buffer is None else buffer.dtype
+        grown = np.empty(shape, dtype=dtype, order=order)
+        if buffer is not None:
+            grown[:n_rows] = buffer[:n_rows]
+        buffer = grown
+    buffer[n_rows:n_total] = rows
+    return buffer
+
+
+cdef class ArrowMatrix:
+    """Zero-copy view of an Arrow record batch of covariates.
+
+    The batch is imported through the Arrow C data interface so its
+    column buffers are read in place; the imported structures are
+    released with the view.
+
+    Attributes
+    ----------
+    shape : (integer, integer)
+        The number of rows and columns.
+    """
+
+    cdef ArrowSchema schema
+    cdef ArrowArray array
+    cdef vector[const void*] columns
+    cdef MatrixView view
+    cdef readonly int n_rows
+    cdef readonly int n_cols
+
+    def __cinit__(self):
+        self.schema.release = NULL
+        self.array.release = NULL
+
+    def __init__(self, batch):
+        """Imports a pyarrow record batch or array.
+
+        Arguments
+        ---------
+        batch : pyarrow.RecordBatch or pyarrow.Array
+            float64 or float32 columns without nulls; an array is a
+            single column.
+
+        Raises
+        ------
+        ValueError
+            If the columns aren't all float64 or all float32 or
+            contain nulls.
+        """
+        batch._export_to_c(<uintptr_t> &self.array, <uintptr_t> &self.schema)
+        self.view = arrow_view(&self.schema, &self.array, self.columns)
+        self.n_rows = self.array.length
+        self.n_cols = self.columns.size()
+
+    def __dealloc__(self):
+        if self.array.release != NULL:
+            self.array.release(&self.array)
+        if self.schema.release != NULL:
+            self.schema.release(&self.schema)
+
+    @property
+    def shape(self):
+        return (self.n_rows, self.n_cols)
+
+    def row(self, int idx):
+        """Copies a row into a new float64 array."""
+        if not 0 <= idx < self.n_rows:
+            raise IndexError("Row {} out of range".format(idx))
+        cdef np.ndarray[double, ndim=1, mode="c"] out = np.empty(self.n_cols)
+        self.view.row(idx, self.n_cols, &out[0])
+        return out
+
+    def to_numpy(self):
+        """Copies the columns into a new float64 matrix."""
+        cdef np.ndarray[double, ndim=2, mode="fortran"] out = \
+            np.empty((self.n_rows, self.n_cols), order="F")
+        cdef int jj
+        if self.n_rows > 0:
+            for jj in range(self.n_cols):
+                self.view.column(jj, self.n_rows, &out[0, jj])
+        return out
+
+
+cdef MatrixView covariate_view(x) except *:
+    """Views covariates given as a numpy matrix or ArrowMatrix."""
+    if isinstance(x, ArrowMatrix):
+        return (<ArrowMatrix> x).view
+    return matrix_view(x)
+
 
 cdef class ForestWrapper:
     """Wrapper for C++ implementation of RFCDE forests.
 
+    Calls into C++ release the GIL. Several threads may predict from
+    the same trained forest at once, but training, adding trees or
+    observations must not overlap with other calls on the forest.
+
     Attributes
     ----------
     Cpp_Call : Forest
@@ -34,6 +239,17 @@ cdef class ForestWrapper:
 
     cdef Forest* Cpp_Class
     cdef int n_train
+    # Training arrays referenced by the C++ object for add_trees.
+    cdef object x_train
+    cdef object z_basis
+    # Over-allocated copies of the training arrays once observations
+    # are added; x_train and z_basis are their first n_train rows.
+    cdef object x_buffer
+    cdef object z_buffer
+    # Narrowest safe weight type; None until computed.
+    cdef object _weight_dtype
+    # Bitvector scorer for apply; NULL until first used.
+    cdef BitvectorScorer* scorer
 
     # Boilerplate
     def __init__(self):
@@ -41,26 +257,37 @@ cdef class ForestWrapper:
     def __cinit__(self):
         self.Cpp_Class = new Forest()
     def __dealloc__(self):
+        del self.scorer
         del self.Cpp_Class
 
+    cdef _invalidate(self):
+        """Drops caches derived from the structure of the trees."""
+        self._weight_dtype = None
+        del self.scorer
+        self.scorer = NULL
+
     @cython.boundscheck(False)
     @cython.wraparound(False)
-    def train(self, np.ndarray[double, ndim=2, mode="fortran"] x_train,
-              np.ndarray[double, ndim=2, mode="fortran"] z_basis,
+    def train(self, x_train, np.ndarray z_basis,
               np.ndarray[int, ndim=1, mode="c"] lens,
               long n_trees, long mtry, long node_size, double min_loss_delta,
-              double flambda, bool fit_oob=False):
+              double flambda, bool fit_oob=False, split_mode="best",
+              long n_thresholds=1, sample_fraction=None, n_partitions=None,
+              max_depth=None, max_leaf_nodes=None, max_time=None, seed=None,
+              n_workers=None):
         """Trains RFCDE on training data.
 
         Arguments
         ---------
-        x_train : numpy matrix
-            The training covariates. Must be stored in "fortran" mode.
+        x_train : numpy matrix or ArrowMatrix
+            The training covariates as float32 or float64 in any
+            memory layout or as Arrow columns; viewed without copying.
         z_basis : numpy matrix
             The training responses evaluated at basis functions; each
             column corresponds to a basis function, each row
             corresponds to an observation. Must be stored in "fortran"
-            mode.
+            mode as float32 or float64; sums are accumulated in double
+            either way.
         lens : numpy array
             The length of each functional variable.
         n_trees : integer
@@ -75,7 +302,58 @@ cdef class ForestWrapper:
             The functional splitting parameter
         fit_oob : boolean
             Whether to fit out-of-bag samples. Defaults to False.
+        split_mode : {'best', 'random'}
+            Whether to evaluate every split point or only random
+            thresholds. Defaults to 'best'.
+        n_thresholds : integer
+            The number of random thresholds per variable when
+            split_mode is 'random'. Defaults to 1.
+        sample_fraction : float or None
+            The fraction of training points sampled without
+            replacement for each tree. Defaults to None which uses
+            bootstrap weights.
+        n_partitions : integer or None
+            The number of partitions of the functional variables
+            shared by the trees. Defaults to None which draws a new
+            partition for each tree.
+        max_depth : integer or None
+            The maximum depth of each tree. Defaults to None for no
+            limit.
+        max_leaf_nodes : integer or None
+            The maximum number of leaves of each tree; trees are
+            grown best-first. Defaults to None for no limit.
+        max_time : float or None
+            A wall-clock budget in seconds after which no further
+            trees are trained. Defaults to None for no limit.
+        seed : integer or None
+            The seed of the random streams of the trees. Defaults to
+            None which draws a seed from numpy's random state.
+        n_workers : integer or None
+            The number of forked worker processes, each training a
+            disjoint range of trees within a shared max_time budget.
+            Defaults to None which trains in-process.
+
+        Raises
+        ------
+        ValueError
+            If the split mode isn't recognized, the sample fraction
+            is outside (0, 1] or a count or limit isn't positive.
         """
+        if split_mode not in SPLIT_MODES:
+            raise ValueError("Split mode {} not recognized".format(split_mode))
+        if sample_fraction is not None and not 0.0 < sample_fraction <= 1.0:
+            raise ValueError("sample_fraction must be in (0, 1]")
+        if n_partitions is not None and n_partitions < 1:
+            raise ValueError("n_partitions must be positive")
+        if max_depth is not None and max_depth < 1:
+            raise ValueError("max_depth must be positive")
+        if max_leaf_nodes is not None and max_leaf_nodes < 1:
+            raise ValueError("max_leaf_nodes must be positive")
+        if max_time is not None and max_time <= 0.0:
+            raise ValueError("max_time must be positive")
+        if n_workers is not None and n_workers < 1:
+            raise ValueError("n_workers must be positive")
+
         self.n_train = x_train.shape[0]
 
         cdef int n_train = x_train.shape[0]
@@ -84,14 +362,244 @@ cdef class ForestWrapper:
         cdef int n_trees_i = n_trees;
         cdef int mtry_i = mtry;
         cdef int node_size_i = node_size;
+        cdef int split_mode_i = SPLIT_MODES[split_mode]
+        cdef int n_thresholds_i = n_thresholds
+        cdef double sample_fraction_d = 0.0 if sample_fraction is None else sample_fraction
+        cdef int n_partitions_i = 0 if n_partitions is None else n_partitions
+        cdef int max_depth_i = 0 if max_depth is None else max_depth
+        cdef int max_leaf_nodes_i = 0 if max_leaf_nodes is None else max_leaf_nodes
+        cdef double max_time_d = 0.0 if max_time is None else max_time
+        if seed is None:
+            seed = np.random.randint(np.iinfo(np.int32).max)
+        cdef int seed_i = seed
+        cdef int n_workers_i = 1 if n_workers is None else n_workers
+
+        self.x_train = x_train
+        self.z_basis = z_basis
+        self.x_buffer = None
+        self.z_buffer = None
+        self._invalidate()
 
         # Pass in pointers of numpy matrices/arrays
-        self.Cpp_Class.train(&x_train[0,0], &z_basis[0,0], &lens[0], n_train, n_var, n_basis, n_trees_i, mtry_i, node_size_i, min_loss_delta, flambda, fit_oob)
+        if not z_basis.flags.f_contiguous:
+            raise ValueError("z_basis must be stored in fortran mode")
+        cdef MatrixView x_view = covariate_view(x_train)
+        cdef MatrixView z_view = matrix_view(z_basis)
+        cdef int* lens_ptr = &lens[0]
+        cdef bool fit_oob_b = fit_oob
+        cdef double min_loss_delta_d = min_loss_delta
+        cdef double flambda_d = flambda
+        with nogil:
+            self.Cpp_Class.train(x_view, z_view, lens_ptr, n_train, n_var, n_basis, n_trees_i, mtry_i, node_size_i, min_loss_delta_d, flambda_d, fit_oob_b, split_mode_i, n_thresholds_i, sample_fraction_d, n_partitions_i, max_depth_i, max_leaf_nodes_i, max_time_d, seed_i, n_workers_i)
+
+    def add_trees(self, long n_trees, max_time=None):
+        """Trains additional trees on the training data.
+
+        Arguments
+        ---------
+        n_trees : integer
+            The number of trees to add.
+        max_time : float or None
+            A wall-clock budget in seconds after which no further
+            trees are trained. Defaults to None for no limit.
+
+        Returns
+        -------
+        integer
+            The number of trees added.
+
+        Raises
+        ------
+        ValueError
+            If the forest hasn't been trained or was deserialized.
+        """
+        if self.x_train is None:
+            raise ValueError("Forest must be trained before adding trees")
+        cdef double max_time_d = 0.0 if max_time is None else max_time
+        cdef int n_trees_i = n_trees
+        cdef int n_added
+        with nogil:
+            n_added = self.Cpp_Class.add_trees(n_trees_i, max_time_d)
+        self._invalidate()
+        return n_added
+
+    def add_observations(self, np.ndarray x_new, np.ndarray z_basis_new):
+        """Adds new observations to the leaves of the trained trees.
+
+        Each observation is routed through every tree and kept by the
+        leaf containing it with a fresh bootstrap weight; the trees
+        are not regrown. The training arrays are copied into buffers
+        with spare rows on the first call and reallocated only when
+        full, so the cost is amortized linear in the number of new
+        observations. Covariates trained from Arrow columns are copied
+        into a dense matrix at that point.
+
+        Arguments
+        ---------
+        x_new : numpy matrix
+            The covariates of the new observations.
+        z_basis_new : numpy matrix
+            The responses of the new observations evaluated at the
+            basis functions.
+
+        Raises
+        ------
+        ValueError
+            If the forest hasn't been trained or was deserialized.
+        """
+        if self.x_train is None:
+            raise ValueError("Forest must be trained before adding observations")
+
+        cdef int n_old = self.n_train
+        if self.x_buffer is None:
+            # First append: copy the training arrays, keeping their
+            # storage precision.
+            x_old = self.x_train
+            if isinstance(x_old, ArrowMatrix):
+                x_old = x_old.to_numpy()
+            self.x_buffer = append_rows(None, 0, x_old)
+            self.z_buffer = append_rows(None, 0, self.z_basis, order="F")
+        self.x_buffer = append_rows(self.x_buffer, n_old, x_new)
+        self.z_buffer = append_rows(self.z_buffer, n_old, z_basis_new,
+                                    order="F")
+        cdef int n_train = n_old + x_new.shape[0]
+        cdef np.ndarray x_train = self.x_buffer[:n_train]
+        cdef np.ndarray z_basis = self.z_buffer[:n_train]
+
+        cdef MatrixView x_view = matrix_view(x_train)
+        cdef MatrixView z_view = matrix_view(z_basis)
+        with nogil:
+            self.Cpp_Class.add_observations(x_view, z_view, n_train)
+        self.x_train = x_train
+        self.z_basis = z_basis
+        self.n_train = n_train
+        self._invalidate()
+
+    def merge(self, ForestWrapper other):
+        """Moves the trees of another forest into this forest.
+
+        Arguments
+        ---------
+        other : ForestWrapper
+            A forest trained on the same data; its trees are moved so
+            it is left empty.
+
+        Raises
+        ------
+        ValueError
+            If the forests were trained on different data or with
+            the same seed, or differ in fitting out-of-bag samples.
+        """
+        if self.n_train == -1 or other.n_train == -1:
+            raise ValueError("Forests must be trained before merging")
+        self.Cpp_Class.merge(other.Cpp_Class[0])
+        self._invalidate()
+        other._invalidate()
+
+    def serialize(self):
+        """Serializes the trees of the forest.
+
+        The training data is not included so a deserialized forest
+        can predict and be merged but not grown further.
+
+        Returns
+        -------
+        bytes
+            The serialized forest.
+        """
+        if self.n_train == -1:
+            raise ValueError("Forest must be trained before serializing")
+        return self.Cpp_Class.serialize()
+
+    def generate_source(self):
+        """C++ source specializing the trained trees.
+
+        Returns
+        -------
+        str
+            Source for a shared library whose `rfcde_apply` fills the
+            same leaf ids as `apply` from C-ordered float64 rows.
+        """
+        if self.n_train == -1:
+            raise ValueError("Forest must be trained before generating code")
+        return generate_source(self.Cpp_Class[0]).decode("ascii")
+
+    def structure_hash(self):
+        """Hash of the splits of the trees, matching generated code."""
+        return structure_hash(self.Cpp_Class[0])
+
+    def deserialize(self, bytes data):
+        """Replaces the forest with one from serialize.
+
+        Arguments
+        ---------
+        data : bytes
+            A forest serialized by `serialize`.
+
+        Raises
+        ------
+        ValueError
+            If data isn't a serialized forest.
+        """
+        self.Cpp_Class.deserialize(data)
+        self.n_train = self.Cpp_Class.n_train
+        self.x_train = None
+        self.z_basis = None
+        self.x_buffer = None
+        self.z_buffer = None
+        self._invalidate()
+
+    def __reduce__(self):
+        if self.n_train == -1:
+            return (ForestWrapper, ())
+        return (_deserialize_forest, (self.serialize(),))
+
+    def n_trees(self):
+        """The number of trained trees.
+
+        This is smaller than the requested number of trees when the
+        time budget is exhausted.
+        """
+        return self.Cpp_Class.n_trees()
+
+    def weight_dtype(self):
+        """The narrowest unsigned integer type holding every weight.
+
+        Each tree adds at most its largest bootstrap weight to an
+        entry, so the sum of those bounds every weight and out-of-bag
+        weight.
+
+        Returns
+        -------
+        numpy dtype
+            uint16, uint32 or int64.
+        """
+        if self._weight_dtype is None:
+            bound = self.Cpp_Class.max_weight()
+            for dtype in (np.uint16, np.uint32):
+                if bound <= np.iinfo(dtype).max:
+                    break
+            else:
+                dtype = np.int64
+            self._weight_dtype = np.dtype(dtype)
+        return self._weight_dtype
+
+    def _checked_dtype(self, dtype):
+        """Resolves a requested weight type, checking integer overflow."""
+        if dtype is None:
+            return self.weight_dtype()
+        dtype = np.dtype(dtype)
+        if dtype not in (np.uint16, np.uint32, np.int64, np.float32):
+            raise ValueError("Weights must be uint16, uint32, int64 or float32")
+        if dtype.kind in "iu" and \
+           self.Cpp_Class.max_weight() > np.iinfo(dtype).max:
+            raise ValueError("Weights may overflow {}".format(dtype))
+        return dtype
 
     @cython.boundscheck(False)
     @cython.wraparound(False)
     def fill_weights(self, np.ndarray[double, ndim=1, mode="c"] x_test,
-                     np.ndarray[long, ndim=1, mode="c"] wt_buf):
+                     np.ndarray[weight_t, ndim=1, mode="c"] wt_buf):
         """Calculate weights from forest tree structure.
 
         Arguments
@@ -100,28 +608,237 @@ cdef class ForestWrapper:
             A new observation.
 
         wt_buf : numpy array
-            An empty buffer to fill with weights. Must have length
-            equal to the number of training points.
+            A zeroed buffer of uint16, uint32, int64 or float32 to
+            fill with weights. Must have length equal to the number
+            of training points; integer types must not overflow.
+
+        """
+        cdef double* x_ptr = &x_test[0]
+        cdef weight_t* wt_ptr = &wt_buf[0]
+        with nogil:
+            self.Cpp_Class.fill_weights(x_ptr, wt_ptr)
+
+    def weights(self, np.ndarray[double, ndim=1, mode="c"] x_test,
+                dtype=None):
+        """The weights of each training point for a new observation.
+
+        Arguments
+        ---------
+        x_test : numpy array
+            A new observation.
+        dtype : numpy dtype or None
+            uint16, uint32, int64 or float32. Defaults to None for
+            `weight_dtype()`.
 
         Returns
         -------
         numpy array
             The weights of each training point for the new observation.
 
+        Raises
+        ------
+        ValueError
+            If the type isn't supported or could overflow.
         """
-        self.Cpp_Class.fill_weights(&x_test[0], &wt_buf[0])
-
-    def weights(self, np.ndarray[double, ndim=1, mode="c"] x_test):
-        wt_buf = np.zeros(self.n_train, dtype=int)
+        wt_buf = np.zeros(self.n_train, dtype=self._checked_dtype(dtype))
         self.fill_weights(x_test, wt_buf)
         return wt_buf
 
+    def normalized_weights(self, np.ndarray[double, ndim=1, mode="c"] x_test):
+        """The weights for a new observation scaled to sum to one.
+
+        Arguments
+        ---------
+        x_test : numpy array
+            A new observation.
+
+        Returns
+        -------
+        numpy array
+            float32 weights of each training point; all zero if no
+            training point shares a leaf with the observation.
+        """
+        cdef np.ndarray[float, ndim=1, mode="c"] wt_buf = \
+            np.zeros(self.n_train, dtype=np.float32)
+        cdef double* x_ptr = &x_test[0]
+        cdef float* wt_ptr = &wt_buf[0]
+        with nogil:
+            self.Cpp_Class.fill_normalized_weights(x_ptr, wt_ptr)
+        return wt_buf
+
+    @cython.boundscheck(False)
+    @cython.wraparound(False)
+    def fill_series_cde(self, np.ndarray[double, ndim=1, mode="c"] x_test,
+                        np.ndarray[double, ndim=2, mode="fortran"] grid_basis,
+                        np.ndarray[double, ndim=1, mode="c"] cde):
+        """Calculate series density estimate from leaf basis sums.
+
+        Arguments
+        ---------
+        x_test : numpy array
+            A new observation.
+        grid_basis : numpy matrix
+            The basis functions evaluated at the grid points; each
+            column corresponds to a basis function, each row
+            corresponds to a grid point. Must be stored in "fortran"
+            mode.
+        cde : numpy array
+            An empty buffer to fill with the density estimate. Must
+            have length equal to the number of grid points.
+
+        """
+        cdef double* x_ptr = &x_test[0]
+        cdef double* grid_ptr = &grid_basis[0, 0]
+        cdef double* cde_ptr = &cde[0]
+        cdef int n_grid = grid_basis.shape[0]
+        with nogil:
+            self.Cpp_Class.predict_series_cde(x_ptr, grid_ptr, n_grid, cde_ptr)
+
+    def series_cde(self, np.ndarray[double, ndim=1, mode="c"] x_test,
+                   np.ndarray[double, ndim=2, mode="fortran"] grid_basis):
+        cde = np.zeros(grid_basis.shape[0])
+        self.fill_series_cde(x_test, grid_basis, cde)
+        return cde
+
+    def apply(self, x_test, n_threads=None, engine="traverse"):
+        """The leaf of each tree containing each new observation.
+
+        Rows are routed in parallel threads; weights and series
+        estimates can then be computed from the leaf ids with
+        `leaf_weights` and `leaf_series_cde` without traversing the
+        trees again.
+
+        Arguments
+        ---------
+        x_test : numpy matrix or ArrowMatrix
+            The new observations as float32 or float64 in any memory
+            layout or as Arrow columns.
+        n_threads : integer or None
+            The number of threads. Defaults to None which uses every
+            hardware thread.
+        engine : string
+            "traverse" follows each row down each tree; "bitvector"
+            scores blocks of rows against the split conditions of all
+            trees sorted by feature, building the conditions on first
+            use.
+
+        Returns
+        -------
+        numpy matrix
+            int32 leaf ids; element [ii, tt] is the leaf of tree tt
+            containing observation ii.
+        """
+        if n_threads is not None and n_threads < 1:
+            raise ValueError("n_threads must be positive")
+        if engine not in ENGINES:
+            raise ValueError("engine must be one of {}".format(ENGINES))
+        cdef int n_test = x_test.shape[0]
+        cdef np.ndarray[int, ndim=2, mode="c"] leaf_ids = \
+            np.zeros((n_test, self.Cpp_Class.n_trees()), dtype=np.intc)
+        if n_test == 0 or leaf_ids.shape[1] == 0:
+            return leaf_ids
+
+        cdef MatrixView x_view = covariate_view(x_test)
+        cdef int* leaf_ptr = &leaf_ids[0, 0]
+        cdef int n_threads_i = 0 if n_threads is None else n_threads
+        cdef BitvectorScorer* scorer = NULL
+        if engine == "bitvector":
+            if self.scorer == NULL:
+                self.scorer = new BitvectorScorer()
+                self.scorer.build(self.Cpp_Class[0])
+            scorer = self.scorer
+        with nogil:
+            self.Cpp_Class.apply(x_view, n_test, leaf_ptr, n_threads_i,
+                                 scorer)
+        return leaf_ids
+
+    cdef int* _leaf_row(self, int[::1] leaf_row) except NULL:
+        """Checks a row of leaf ids from `apply`."""
+        if leaf_row.shape[0] != self.Cpp_Class.n_trees() or \
+           leaf_row.shape[0] == 0 or \
+           not self.Cpp_Class.valid_leaf_ids(&leaf_row[0], 1):
+            raise ValueError("Leaf ids don't match the trees of the forest")
+        return &leaf_row[0]
+
+    def fill_leaf_weights(self, np.ndarray[int, ndim=1, mode="c"] leaf_row,
+                          np.ndarray[weight_t, ndim=1, mode="c"] wt_buf):
+        cdef int* leaf_ptr = self._leaf_row(leaf_row)
+        cdef weight_t* wt_ptr = &wt_buf[0]
+        with nogil:
+            self.Cpp_Class.fill_leaf_weights(leaf_ptr, wt_ptr)
 
-    def fill_oob_weights(self, np.ndarray[long, ndim=2, mode="fortran"] wt_mat):
-        self.Cpp_Class.fill_oob_weights(&wt_mat[0,0])
+    def leaf_weights(self, np.ndarray[int, ndim=1, mode="c"] leaf_row,
+                     dtype=None):
+        """The weights of each training point for a row of `apply`.
 
-    def oob_weights(self):
-        wt_mat = np.zeros((self.n_train, self.n_train), dtype=int, order="F")
+        Arguments
+        ---------
+        leaf_row : numpy array
+            The int32 leaf ids of an observation.
+        dtype : numpy dtype or None
+            uint16, uint32, int64 or float32. Defaults to None for
+            `weight_dtype()`.
+
+        Returns
+        -------
+        numpy array
+            The same weights as `weights` for the observation.
+        """
+        wt_buf = np.zeros(self.n_train, dtype=self._checked_dtype(dtype))
+        self.fill_leaf_weights(leaf_row, wt_buf)
+        return wt_buf
+
+    def leaf_series_cde(self, np.ndarray[int, ndim=1, mode="c"] leaf_row,
+                        np.ndarray[double, ndim=2, mode="fortran"] grid_basis):
+        """The series density estimate for a row of `apply`.
+
+        Arguments
+        ---------
+        leaf_row : numpy array
+            The int32 leaf ids of an observation.
+        grid_basis : numpy matrix
+            The basis functions evaluated at the grid points. Must be
+            stored in "fortran" mode.
+
+        Returns
+        -------
+        numpy array
+            The same estimate as `series_cde` for the observation.
+        """
+        cdef int* leaf_ptr = self._leaf_row(leaf_row)
+        cdef np.ndarray[double, ndim=1, mode="c"] cde = \
+            np.zeros(grid_basis.shape[0])
+        cdef double* grid_ptr = &grid_basis[0, 0]
+        cdef double* cde_ptr = &cde[0]
+        cdef int n_grid = grid_basis.shape[0]
+        with nogil:
+            self.Cpp_Class.predict_leaf_series_cde(leaf_ptr, grid_ptr, n_grid,
+                                                   cde_ptr)
+        return cde
+
+    def fill_oob_weights(self,
+                         np.ndarray[weight_t, ndim=2, mode="fortran"] wt_mat):
+        cdef weight_t* wt_ptr = &wt_mat[0,0]
+        with nogil:
+            self.Cpp_Class.fill_oob_weights(wt_ptr)
+
+    def oob_weights(self, dtype=None):
+        """Out-of-bag weights of the training points.
+
+        Arguments
+        ---------
+        dtype : numpy dtype or None
+            uint16, uint32, int64 or float32. Defaults to None for
+            `weight_dtype()`.
+
+        Returns
+        -------
+        numpy matrix
+            Element [ii, jj] is the out-of-bag weight of training
+            point jj for training point ii.
+        """
+        wt_mat = np.zeros((self.n_train, self.n_train),
+                          dtype=self._checked_dtype(dtype), order="F")
         self.fill_oob_weights(wt_mat)
         return wt_mat
 
@@ -142,7 +859,9 @@ cdef class ForestWrapper:
             The loss importance measures for each variable.
 
         """
-        self.Cpp_Class.fill_loss_importance(&imp[0])
+        cdef double* imp_ptr = &imp[0]
+        with nogil:
+            self.Cpp_Class.fill_loss_importance(imp_ptr)
 
     @cython.boundscheck(False)
     @cython.wraparound(False)
@@ -161,4 +880,120 @@ cdef class ForestWrapper:
             The count importance measures for each variable.
 
         """
-        self.Cpp_Class.fill_count_importance(&imp[0])
+        cdef double* imp_ptr = &imp[0]
+        with nogil:
+            self.Cpp_Class.fill_count_importance(imp_ptr)
+
+
+def _deserialize_forest(data):
+    forest = ForestWrapper()
+    forest.deserialize(data)
+    return forest
+
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+def kde_loss(np.ndarray[double, ndim=2, mode="fortran"] z_train,
+             np.ndarray[double, ndim=2, mode="fortran"] z_test,
+             np.ndarray[weight_t, ndim=2, mode="fortran"] wt_mat,
+             np.ndarray[double, ndim=1, mode="c"] bandwidths):
+    """Calculates the KDE CDE loss for several candidate bandwidths.
+
+    Pairwise distances are computed once per test point and shared
+    across all of the candidate bandwidths.
+
+    Arguments
+    ---------
+    z_train : numpy matrix
+        The training responses. Must be stored in "fortran" mode.
+    z_test : numpy matrix
+        The test responses. Must be stored in "fortran" mode.
+    wt_mat : numpy matrix
+        The weights as uint16, uint32, int64 or float32; element
+        [ii, jj] is the weight of training point jj for test point
+        ii. Must be stored in "fortran" mode.
+    bandwidths : numpy array
+        The candidate bandwidths.
+
+    Returns
+    -------
+    (numpy array, integer)
+        The CDE loss for each bandwidth and the index of the bandwidth
+        with the smallest loss.
+
+    Raises
+    ------
+    ValueError
+        If there are no candidate bandwidths or any isn't positive.
+
+    """
+    if bandwidths.shape[0] < 1:
+        raise ValueError("At least one bandwidth is required")
+    if not np.all(bandwidths > 0):
+        raise ValueError("Bandwidths must be positive")
+
+    cdef int n_train = z_train.shape[0]
+    cdef int n_test = z_test.shape[0]
+    cdef int n_dim = z_train.shape[1]
+    cdef int n_bandwidths = bandwidths.shape[0]
+    cdef np.ndarray[double, ndim=1, mode="c"] losses = np.zeros(n_bandwidths)
+
+    cdef double* z_train_ptr = &z_train[0, 0]
+    cdef double* z_test_ptr = &z_test[0, 0]
+    cdef weight_t* wt_ptr = &wt_mat[0, 0]
+    cdef double* bandwidths_ptr = &bandwidths[0]
+    cdef double* losses_ptr = &losses[0]
+    cdef int best
+    with nogil:
+        best = kde_loss_curve(z_train_ptr, z_test_ptr, wt_ptr,
+                              n_train, n_test, n_dim,
+                              bandwidths_ptr, n_bandwidths, losses_ptr)
+    return losses, best
+
+
+BANDWIDTH_RULES = {"plugin": 0, "silverman": 1, "scott": 2}
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+def weighted_bandwidth(np.ndarray[double, ndim=2, mode="fortran"] z_train,
+                       np.ndarray[double, ndim=1, mode="c"] weights,
+                       rule):
+    """Selects a KDE bandwidth from weighted responses.
+
+    Only observations with positive weight are visited; observations
+    are never replicated by weight.
+
+    Arguments
+    ---------
+    z_train : numpy matrix
+        The training responses. Must be stored in "fortran" mode.
+    weights : numpy array
+        The weight of each training response.
+    rule : {'plugin', 'silverman', 'scott'}
+        The bandwidth selection rule.
+
+    Returns
+    -------
+    numpy array
+        The bandwidth for each response dimension.
+
+    Raises
+    ------
+    ValueError
+        If the rule isn't recognized.
+    """
+    if rule not in BANDWIDTH_RULES:
+        raise ValueError("Bandwidth rule {} not recognized".format(rule))
+
+    cdef int n_train = z_train.shape[0]
+    cdef int n_dim = z_train.shape[1]
+    cdef np.ndarray[double, ndim=1, mode="c"] bandwidth = np.zeros(n_dim)
+
+    cdef double* z_train_ptr = &z_train[0, 0]
+    cdef double* weights_ptr = &weights[0]
+    cdef double* bandwidth_ptr = &bandwidth[0]
+    cdef int rule_i = BANDWIDTH_RULES[rule]
+    with nogil:
+        select_bandwidth(z_train_ptr, weights_ptr, n_train, n_dim, rule_i,
+                         bandwidth_ptr)
+    return bandwidth
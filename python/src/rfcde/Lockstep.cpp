@@ -0,0 +1 @@
+../../../cpp/Lockstep.cpp
\ No newline at end of file
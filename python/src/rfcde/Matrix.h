@@ -0,0 +1 @@
+../../../cpp/Matrix.h
\ No newline at end of file
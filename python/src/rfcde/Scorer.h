@@ -0,0 +1 @@
+../../../cpp/Scorer.h
\ No newline at end of file
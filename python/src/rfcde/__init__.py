@@ -1,2 +1,3 @@
 """Implementation of RFCDE; wraps C++ implementation."""
 from .core import RFCDE
+from .compiled import CompiledForest
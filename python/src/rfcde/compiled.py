@@ -0,0 +1,70 @@
+"""Loads forests compiled from generated C++ source."""
+
+# Copyright Taylor Pospisil 2018.
+# Distributed under MIT License (http://opensource.org/licenses/MIT)
+
+import ctypes
+
+import numpy as np
+
+
+class CompiledForest(object):
+    """Leaf-id predictor from a shared library built by `RFCDE.compile`.
+
+    The library only routes observations; weights and density
+    estimates come from passing its leaf ids to the `leaf_ids`
+    argument of the RFCDE prediction methods.
+
+    Arguments
+    ---------
+    path : string
+        Path to the shared library.
+    forest : RFCDE
+        The forest the library was generated from.
+
+    Raises
+    ------
+    ValueError
+        If the library was generated from a different forest.
+
+    """
+    def __init__(self, path, forest):
+        self.lib = ctypes.CDLL(path)
+        self.lib.rfcde_n_trees.restype = ctypes.c_int
+        self.lib.rfcde_n_var.restype = ctypes.c_int
+        self.lib.rfcde_structure.restype = ctypes.c_uint64
+        self.lib.rfcde_apply.restype = None
+        self.lib.rfcde_apply.argtypes = [
+            np.ctypeslib.ndpointer(np.float64, ndim=2, flags="C"),
+            ctypes.c_int,
+            np.ctypeslib.ndpointer(np.intc, ndim=2, flags="C")]
+
+        self.n_trees = self.lib.rfcde_n_trees()
+        self.n_var = self.lib.rfcde_n_var()
+        if self.lib.rfcde_structure() != forest.forest.structure_hash():
+            raise ValueError("Compiled forest does not match the forest")
+
+    def apply(self, x_new):
+        """Find the leaf of each tree containing new observations.
+
+        Arguments
+        ---------
+        x_new : numpy array/matrix
+           The covariates for the new observations. Each row/value
+           corresponds to an observation.
+
+        Returns
+        -------
+        numpy matrix
+           int32 leaf ids; element [ii, tt] is the leaf of tree tt
+           containing observation ii.
+        """
+        x_new = np.ascontiguousarray(x_new, dtype=np.float64)
+        if len(x_new.shape) == 1:
+            x_new = x_new.reshape((1, len(x_new)))
+        if x_new.shape[1] != self.n_var:
+            raise ValueError("x_new must have same dimensions as x_train")
+
+        leaf_ids = np.zeros((x_new.shape[0], self.n_trees), dtype=np.intc)
+        self.lib.rfcde_apply(x_new, x_new.shape[0], leaf_ids)
+        return leaf_ids
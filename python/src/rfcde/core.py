@@ -3,14 +3,17 @@
 # Copyright Taylor Pospisil 2018.
 # Distributed under MIT License (http://opensource.org/licenses/MIT)
 
+import os
+import subprocess
 from warnings import warn
 
 import numpy as np
 
 from .basis_functions import evaluate_basis
+from .compiled import CompiledForest
 from .kde import kde
 from .weighted_quantile import weighted_quantile
-from .ForestWrapper import ForestWrapper
+from .ForestWrapper import ArrowMatrix, ForestWrapper, append_rows, kde_loss
 
 
 # Helper function
@@ -34,6 +37,79 @@ def _box(responses, box_min, box_max):
     return (responses - box_min) / (box_max - box_min)
 
 
+def _is_arrow(data):
+    """Whether data is a pyarrow record batch, table or array."""
+    return hasattr(data, "_export_to_c") or hasattr(data, "to_batches")
+
+
+def _arrow_matrix(data):
+    """Views a pyarrow record batch, table or array without copying.
+
+    Tables are combined into a single batch, which only copies
+    columns split over several chunks.
+    """
+    if hasattr(data, "to_batches"):
+        batches = data.combine_chunks().to_batches()
+        if not batches:
+            raise ValueError("Arrow table has no rows")
+        data = batches[0]
+    return ArrowMatrix(data)
+
+
+def _arrow_to_numpy(data):
+    """Converts pyarrow responses to a numpy array/matrix."""
+    if hasattr(data, "columns"):
+        return np.column_stack([np.asarray(col, dtype=float)
+                                for col in data.columns])
+    return np.asarray(data, dtype=float)
+
+
+def _leaf_matrix(leaf_ids):
+    """Coerces leaf ids from `RFCDE.apply` to a C-ordered int32 matrix."""
+    leaf_ids = np.ascontiguousarray(leaf_ids, dtype=np.intc)
+    if len(leaf_ids.shape) == 1:
+        leaf_ids = leaf_ids.reshape((1, len(leaf_ids)))
+    return leaf_ids
+
+
+def _rows(x_new):
+    """Iterates over the observations of covariates.
+
+    Arrow tables are read one record batch at a time from the column
+    buffers, so chunked data is streamed without forming a dense
+    matrix.
+
+    Arguments
+    ---------
+    x_new : numpy array/matrix or pyarrow data
+       The covariates. A numpy array is a single observation.
+
+    Returns
+    -------
+    (integer, iterator)
+       The number of observations and an iterator over them as
+       contiguous float64 arrays.
+    """
+    if _is_arrow(x_new):
+        batches = x_new.to_batches() if hasattr(x_new, "to_batches") else [x_new]
+
+        def arrow_rows():
+            for batch in batches:
+                matrix = ArrowMatrix(batch)
+                for idx in range(matrix.n_rows):
+                    yield matrix.row(idx)
+
+        return len(x_new), arrow_rows()
+
+    if len(x_new.shape) == 1:
+        x_new = x_new.reshape((1, len(x_new)))
+    return x_new.shape[0], (np.ascontiguousarray(x_new[idx, :], dtype=float)
+                            for idx in range(x_new.shape[0]))
+
+
+PRECISIONS = {"float64": np.float64, "float32": np.float32}
+
+
 class RFCDE(object):
     """Object for RFCDE.
 
@@ -74,6 +150,10 @@ class RFCDE(object):
        Number of training covariates
     lens : numpy array
        The lengths of functional variables; scalar variables will have a length of 1.
+    z_min : numpy array
+       The minimum of the training responses in each dimension.
+    z_max : numpy array
+       The maximum of the training responses in each dimension.
     forest : ForestWrapper
        Wrapped C++ forest
 
@@ -92,21 +172,32 @@ class RFCDE(object):
         self.min_loss_delta = min_loss_delta
         self.n_basis = n_basis
         self.z_train = None
+        # Over-allocated responses once observations are added;
+        # z_train is its first rows.
+        self._z_buffer = None
         self.basis_system = basis_system
         self.lens = None
         self.forest = ForestWrapper()
 
-    def train(self, x_train, z_train, lens=None, flambda=1.0, fit_oob=False):
+    def train(self, x_train, z_train, lens=None, flambda=1.0, fit_oob=False,
+              split_mode="best", n_thresholds=1, sample_fraction=None,
+              n_partitions=None, max_depth=None, max_leaf_nodes=None,
+              max_time=None, seed=None, n_workers=None, precision="float64"):
         """Train RFCDE object on training data.
 
         Arguments
         ---------
         x_train : numpy array/matrix
            The training covariates. Each value/row corresponds to an
-           observation.
+           observation. float32 and float64 arrays are used in place
+           in any memory layout; the forest keeps a reference for
+           adding trees so the array should not be modified.
+           pyarrow record batches and tables of float32 or float64
+           columns are read in place through the Arrow C data
+           interface.
         z_train : numpy array/matrix
            The training responses. Each value/row corresponds to an
-           observation.
+           observation. pyarrow responses are converted to numpy.
         lens : numpy array
            The lengths of functional variables. Defaults to treating
            each variable as a scalar.
@@ -114,24 +205,95 @@ class RFCDE(object):
            The functional splitting parameter
         fit_oob : boolean
            Whether to fit out-of-bag observations.
+        split_mode : {'best', 'random'}
+           How split points are chosen: 'best' evaluates every split
+           point of the sorted observations while 'random' evaluates
+           `n_thresholds` random thresholds per variable without
+           sorting (extremely randomized trees).
+        n_thresholds : integer
+           The number of random thresholds per variable when
+           `split_mode` is 'random'.
+        sample_fraction : float or None
+           The fraction of observations drawn without replacement for
+           each tree. Each tree is grown only on its sample so
+           training cost scales with the sample size. Defaults to
+           None, which uses bootstrap weights on every observation.
+        n_partitions : integer or None
+           The size of a pool of random partitions of the functional
+           variables. Each tree uses a partition from the pool so the
+           aggregated features of a partition are only computed once.
+           Defaults to None, which draws a new partition per tree.
+        max_depth : integer or None
+           The maximum depth of each tree. Defaults to None for no
+           limit.
+        max_leaf_nodes : integer or None
+           The maximum number of leaves of each tree. Limited trees
+           are grown best-first, always splitting the leaf with the
+           largest decrease in loss. Defaults to None for no limit.
+        max_time : float or None
+           A wall-clock budget in seconds for training. No further
+           trees are added once it is exhausted, so fewer than
+           `n_trees` trees may be trained. Defaults to None for no
+           limit.
+        seed : integer or None
+           The seed of the random streams of the trees; each tree,
+           including those from `add_trees`, is grown from a stream
+           seeded by `(seed, i)` for its own index `i`. Defaults to
+           None which draws a seed from numpy's random state.
+        n_workers : integer or None
+           The number of worker processes forked to train disjoint
+           ranges of trees. Workers share the training data with the
+           parent and a shard whose worker crashes is retrained, so
+           without `max_time` the forest is the same as from training
+           in-process. With `max_time` the workers share the budget;
+           each trains at least one tree and the rest of a range cut
+           short is skipped rather than grown later. Defaults to
+           None, which trains in-process.
+        precision : {'float64', 'float32'}
+           The storage precision of the basis evaluations kept for
+           training, adding trees and adding observations. 'float32'
+           halves their memory and the traffic of reading them in
+           split searches; sums are still accumulated in float64.
+           Covariates are used at their own precision either way,
+           since split searches work on ranks of their values.
+           Defaults to 'float64'.
+
+        Raises
+        ------
+        ValueError
+            If the precision isn't recognized.
 
         """
+        if precision not in PRECISIONS:
+            raise ValueError("Precision {} not recognized".format(precision))
+        dtype = PRECISIONS[precision]
+
         # Coerce to matrices
-        if len(x_train.shape) == 1:
-            x_train = x_train.reshape((len(x_train), 1))
+        if _is_arrow(x_train):
+            x_train = _arrow_matrix(x_train)
+        else:
+            if len(x_train.shape) == 1:
+                x_train = x_train.reshape((len(x_train), 1))
+            # Covariates are viewed in place; only other dtypes are copied.
+            if x_train.dtype not in (np.float32, np.float64):
+                x_train = x_train.astype(float)
+        if _is_arrow(z_train):
+            z_train = _arrow_to_numpy(z_train)
         if len(z_train.shape) == 1:
             z_train = z_train.reshape((len(z_train), 1))
 
         self.n_var = x_train.shape[1]
         self.z_train = z_train
+        self._z_buffer = None
 
-        if not lens:
+        if lens is None:
             lens = np.array([1] * self.n_var, dtype=np.intc)
-        if lens.dtype != np.intc:
-            lens = lens.astype(np.cint)
+        lens = np.asarray(lens, dtype=np.intc)
 
         z_min = z_train.min(0)
         z_max = z_train.max(0)
+        self.z_min = z_min
+        self.z_max = z_max
         if self.mtry > x_train.shape[1]:
             warn(
                 "mtry larger than number of covariates; \
@@ -141,12 +303,208 @@ class RFCDE(object):
         z_basis = evaluate_basis(_box(z_train, z_min, z_max), self.n_basis,
                                  self.basis_system)
 
-        self.forest.train(np.asfortranarray(x_train),
-                          np.asfortranarray(z_basis), np.asfortranarray(lens),
+        self.forest.train(x_train,
+                          np.asfortranarray(z_basis, dtype=dtype),
+                          np.asfortranarray(lens),
                           self.n_trees, self.mtry, self.node_size,
-                          self.min_loss_delta, flambda, fit_oob)
+                          self.min_loss_delta, flambda, fit_oob,
+                          split_mode, n_thresholds, sample_fraction,
+                          n_partitions, max_depth, max_leaf_nodes, max_time,
+                          seed, n_workers)
         self.fit_oob = fit_oob
 
+    def add_trees(self, n_trees, max_time=None):
+        """Add trees to a trained forest.
+
+        The new trees are grown on the training data with the
+        training parameters, continuing the random streams so that
+        adding trees in several steps gives the same forest as
+        training them at once.
+
+        Arguments
+        ---------
+        n_trees : integer
+           The number of trees to add.
+        max_time : float or None
+           A wall-clock budget in seconds. Defaults to None for no
+           limit.
+
+        Returns
+        -------
+        integer
+           The number of trees added.
+
+        """
+        return self.forest.add_trees(n_trees, max_time)
+
+    def add_observations(self, x_new, z_new):
+        """Add newly labelled observations to a trained forest.
+
+        Each observation is routed through the existing trees and
+        kept by the leaf containing it with a fresh bootstrap weight.
+        Training data are kept in buffers with spare rows, so the cost
+        is amortized linear in the number of new observations. The
+        trees are not regrown; weights and all predictions use the
+        new observations afterwards, and trees added later are grown
+        on all observations. Responses keep the basis scaling of the
+        training responses.
+
+        Arguments
+        ---------
+        x_new : numpy array/matrix
+           The covariates of the new observations. Each value/row
+           corresponds to an observation.
+        z_new : numpy array/matrix
+           The responses of the new observations. Each value/row
+           corresponds to an observation.
+
+        """
+        if _is_arrow(x_new):
+            x_new = _arrow_matrix(x_new).to_numpy()
+        if _is_arrow(z_new):
+            z_new = _arrow_to_numpy(z_new)
+        if len(x_new.shape) == 1:
+            x_new = x_new.reshape((len(x_new), 1))
+        if len(z_new.shape) == 1:
+            z_new = z_new.reshape((len(z_new), 1))
+        if x_new.shape[1] != self.n_var:
+            raise ValueError("x_new must have same dimensions as x_train")
+        if z_new.shape[1] != self.z_train.shape[1]:
+            raise ValueError("z_new must have same dimensions as z_train")
+
+        z_basis = evaluate_basis(_box(z_new, self.z_min, self.z_max),
+                                 self.n_basis, self.basis_system)
+        if x_new.dtype not in (np.float32, np.float64):
+            x_new = x_new.astype(float)
+        self.forest.add_observations(x_new,
+                                     np.asarray(z_basis, dtype=float))
+        n_old = self.z_train.shape[0]
+        if getattr(self, "_z_buffer", None) is None:
+            self._z_buffer = append_rows(None, 0, self.z_train)
+        self._z_buffer = append_rows(self._z_buffer, n_old, z_new)
+        self.z_train = self._z_buffer[:n_old + z_new.shape[0]]
+
+    def __getstate__(self):
+        # The spare rows of the response buffer are not pickled.
+        state = self.__dict__.copy()
+        state["_z_buffer"] = None
+        return state
+
+    def merge(self, other):
+        """Merge the trees of another forest into this forest.
+
+        Forests trained on the same data with different seeds, for
+        example on separate hosts, can be combined into one model.
+        RFCDE objects can be pickled to move them between processes;
+        unpickled forests can predict and be merged but hold no
+        training data for adding trees or observations.
+
+        Arguments
+        ---------
+        other : RFCDE
+           A forest trained on the same data. Its trees are moved so
+           it is left empty.
+
+        Raises
+        ------
+        ValueError
+            If the forests were trained on different data or with
+            the same seed, or differ in fitting out-of-bag samples.
+
+        """
+        self.forest.merge(other.forest)
+
+    def apply(self, x_new, n_threads=None, engine="traverse"):
+        """Find the leaf of each tree containing new observations.
+
+        Routing is done once, in parallel threads; the leaf ids can be
+        passed as `leaf_ids` to the prediction methods, which then
+        never traverse the trees.
+
+        Arguments
+        ---------
+        x_new : numpy array/matrix or pyarrow data
+           The covariates for the new observations. Each row/value
+           corresponds to an observation.
+        n_threads : integer or None
+           The number of threads. Defaults to None which uses every
+           hardware thread.
+        engine : string
+           "traverse" follows each observation down each tree;
+           "bitvector" scores blocks of observations against the
+           split conditions of all trees sorted by feature, which
+           only pays off for shallow trees with few leaves.
+
+        Returns
+        -------
+        numpy matrix
+           int32 leaf ids; element [ii, tt] is the leaf of tree tt
+           containing observation ii.
+        """
+        if _is_arrow(x_new):
+            x_new = _arrow_matrix(x_new)
+        else:
+            if len(x_new.shape) == 1:
+                x_new = x_new.reshape((1, len(x_new)))
+            if x_new.dtype not in (np.float32, np.float64):
+                x_new = x_new.astype(float)
+        if x_new.shape[1] != self.n_var:
+            raise ValueError("x_new must have same dimensions as x_train")
+        return self.forest.apply(x_new, n_threads, engine)
+
+    def compile(self, path, cxx=None, flags=("-O2",)):
+        """Compile the trained trees into a shared library.
+
+        The trees are specialized into C++ source, written next to the
+        library as `path` + ".cpp", and compiled. Small trees become
+        nested conditions with thresholds inlined; large or deep trees
+        become node tables walked by a loop, which compile quickly but
+        route no faster than `apply`. The forest should not change
+        afterwards; observations may still be added since they do not
+        move leaves. A process keeps the first library loaded from a
+        path, so recompiled forests need new paths.
+
+        Arguments
+        ---------
+        path : string
+           Path of the shared library to write.
+        cxx : string or None
+           The C++ compiler. Defaults to None which uses the CXX
+           environment variable or "c++".
+        flags : sequence of strings
+           Additional compiler flags.
+
+        Returns
+        -------
+        CompiledForest
+           The loaded library; its `apply` returns the same leaf ids
+           as `apply` for use with the `leaf_ids` arguments.
+        """
+        source = path + ".cpp"
+        with open(source, "w") as f:
+            f.write(self.forest.generate_source())
+        if cxx is None:
+            cxx = os.environ.get("CXX", "c++")
+        subprocess.check_call([cxx] + list(flags) +
+                              ["-shared", "-fPIC", "-o", path, source])
+        return CompiledForest(path, self)
+
+    def _weight_rows(self, x_new, leaf_ids):
+        """Iterates over the weights of new observations.
+
+        Returns
+        -------
+        (integer, iterator)
+           The number of observations and an iterator over their
+           weights, computed from `leaf_ids` when given.
+        """
+        if leaf_ids is None:
+            n_test, rows = _rows(x_new)
+            return n_test, (self.weights(x_row) for x_row in rows)
+        leaf_ids = _leaf_matrix(leaf_ids)
+        return leaf_ids.shape[0], (self.forest.leaf_weights(leaf_row)
+                                   for leaf_row in leaf_ids)
+
     def weights(self, x_new):
         """Calculate weights from forest tree structure.
 
@@ -158,7 +516,9 @@ class RFCDE(object):
         Returns
         -------
         numpy array
-            The weights of each training point for the new observation.
+            The weights of each training point for the new observation
+            in the narrowest unsigned integer type holding any weight
+            of the forest.
         """
         if len(x_new.shape) != 1 or len(x_new) != self.n_var:
             raise ValueError("x_new must have same dimensions as x_train")
@@ -172,7 +532,8 @@ class RFCDE(object):
         numpy matrix
             A matrix with element [ii, jj] being the out-of-bag weight
             for training point jj when predicting for training point
-            ii.
+            ii, in the narrowest unsigned integer type holding any
+            weight of the forest.
 
         Raises
         ------
@@ -184,15 +545,16 @@ class RFCDE(object):
             raise ValueError("Forest was not fit with out-of-bag samples")
         return self.forest.oob_weights()
 
-    def predict(self, x_new, z_grid, bandwidth):
+    def predict(self, x_new, z_grid, bandwidth, leaf_ids=None):
         """Calculate KDE conditional density estimate for new observations.
 
         Arguments
         ---------
-        x_new : numpy array/matrix
+        x_new : numpy array/matrix or pyarrow data
            The covariates for the new observations. Each row/value
            corresponds to an observation. Must have the same
-           dimensionality as the training covariates.
+           dimensionality as the training covariates. pyarrow tables
+           are streamed one record batch at a time.
         z_grid : numpy array/matrix
            The grid points at which to estimate the conditional
            densities.
@@ -202,6 +564,9 @@ class RFCDE(object):
            "cv_ml", and "cv_ls" for reference, maximum likelihood
            cross validation, and least-squares cross validation
            respectively.
+        leaf_ids : numpy matrix or None
+           (optional) Leaf ids of the new observations from `apply`,
+           used instead of `x_new`.
 
         Returns
         -------
@@ -214,73 +579,176 @@ class RFCDE(object):
         # Coerce to matrices
         if len(z_grid.shape) == 1:
             z_grid = z_grid.reshape((len(z_grid), 1))
-        if len(x_new.shape) == 1:
-            x_new = x_new.reshape((1, len(x_new)))
 
-        n_test = x_new.shape[0]
+        n_test, weight_rows = self._weight_rows(x_new, leaf_ids)
         n_grid = z_grid.shape[0]
         cde = np.zeros((n_test, n_grid))
-        for idx in range(n_test):
-            weights = self.weights(np.ascontiguousarray(x_new[idx, :]))
+        for idx, weights in enumerate(weight_rows):
             cde[idx, :] = kde(self.z_train, z_grid, weights, bandwidth)
         return cde
 
-    def predict_mean(self, x_new):
+    def predict_series(self, x_new, z_grid, leaf_ids=None):
+        """Calculate series conditional density estimate for new observations.
+
+        The estimate is the orthogonal series expansion with
+        coefficients averaged from the weighted basis sums of the
+        leaves. Unlike `predict` it does not visit the training
+        responses.
+
+        Arguments
+        ---------
+        x_new : numpy array/matrix or pyarrow data
+           The covariates for the new observations. Each row/value
+           corresponds to an observation. Must have the same
+           dimensionality as the training covariates. pyarrow tables
+           are streamed one record batch at a time.
+        z_grid : numpy array/matrix
+           The grid points at which to estimate the conditional
+           densities.
+        leaf_ids : numpy matrix or None
+           (optional) Leaf ids of the new observations from `apply`,
+           used instead of `x_new`.
+
+        Returns
+        -------
+        numpy matrix
+           A matrix of conditional density estimates; each column
+          corresponds to a grid point, each row corresponds to an
+          observation. Negative estimates are truncated to zero.
+
+        """
+        # Coerce to matrices
+        if len(z_grid.shape) == 1:
+            z_grid = z_grid.reshape((len(z_grid), 1))
+
+        z_box = _box(z_grid, self.z_min, self.z_max)
+        grid_basis = np.asfortranarray(evaluate_basis(z_box, self.n_basis,
+                                                      self.basis_system))
+        in_box = np.all((z_box >= 0.0) & (z_box <= 1.0), axis=1)
+        scale = np.prod(self.z_max - self.z_min)
+
+        if leaf_ids is None:
+            n_test, rows = _rows(x_new)
+            series = (self.forest.series_cde(x_row, grid_basis)
+                      for x_row in rows)
+        else:
+            leaf_ids = _leaf_matrix(leaf_ids)
+            n_test = leaf_ids.shape[0]
+            series = (self.forest.leaf_series_cde(leaf_row, grid_basis)
+                      for leaf_row in leaf_ids)
+
+        n_grid = z_grid.shape[0]
+        cde = np.zeros((n_test, n_grid))
+        for idx, row_cde in enumerate(series):
+            cde[idx, :] = row_cde / scale
+        return np.where(in_box, np.maximum(cde, 0.0), 0.0)
+
+    def predict_mean(self, x_new, leaf_ids=None):
         """Calculate conditional mean estimate for new observations.
 
         Arguments
         ---------
-        x_new : numpy array/matrix
+        x_new : numpy array/matrix or pyarrow data
            The covariates for the new observations. Each row/value
            corresponds to an observation. Must have the same
-           dimensionality as the training covariates.
+           dimensionality as the training covariates. pyarrow tables
+           are streamed one record batch at a time.
+        leaf_ids : numpy matrix or None
+           (optional) Leaf ids of the new observations from `apply`,
+           used instead of `x_new`.
 
         Returns
         -------
         numpy array
            An array of conditional mean estimates.
         """
-        # Coerce to matrix
-        if len(x_new.shape) == 1:
-            x_new = x_new.reshape((1, len(x_new)))
-
-        n_test = x_new.shape[0]
+        n_test, weight_rows = self._weight_rows(x_new, leaf_ids)
         means = np.zeros(n_test)
-        for idx in range(n_test):
-            weights = self.weights(np.ascontiguousarray(x_new[idx, :]))
+        for idx, weights in enumerate(weight_rows):
             means[idx] = np.average(self.z_train.reshape(-1, ),
                                     weights=weights)
         return means
 
-    def predict_quantile(self, x_new, quantile):
+    def predict_quantile(self, x_new, quantile, leaf_ids=None):
         """Calculate conditional quantile estimate for new observations.
 
         Arguments
         ---------
-        x_new : numpy array/matrix
+        x_new : numpy array/matrix or pyarrow data
            The covariates for the new observations. Each row/value
            corresponds to an observation. Must have the same
-           dimensionality as the training covariates.
+           dimensionality as the training covariates. pyarrow tables
+           are streamed one record batch at a time.
         quantile : float
            The quantile to estimate (between 0 and 1).
+        leaf_ids : numpy matrix or None
+           (optional) Leaf ids of the new observations from `apply`,
+           used instead of `x_new`.
 
         Returns
         -------
         numpy array
            An array of conditional quantile estimates.
         """
-        # Coerce to matrix
-        if len(x_new.shape) == 1:
-            x_new = x_new.reshape((1, len(x_new)))
-
-        n_test = x_new.shape[0]
+        n_test, weight_rows = self._weight_rows(x_new, leaf_ids)
         quantiles = np.zeros(n_test)
-        for idx in range(n_test):
-            weights = self.weights(np.ascontiguousarray(x_new[idx, :]))
+        for idx, weights in enumerate(weight_rows):
             quantiles[idx] = weighted_quantile(self.z_train.reshape(-1, ),
                                                weights, quantile)
         return quantiles
 
+    def tune_bandwidth(self, bandwidths, x_test=None, z_test=None):
+        """Select a constant bandwidth minimizing the KDE CDE loss.
+
+        The loss is estimated from out-of-bag weights unless test data
+        is provided. All candidate bandwidths are evaluated in a single
+        pass over the weights.
+
+        Arguments
+        ---------
+        bandwidths : numpy array
+           The candidate bandwidths.
+        x_test : numpy array/matrix
+           (optional) The covariates for holdout observations.
+        z_test : numpy array/matrix
+           (optional) The responses for holdout observations.
+
+        Returns
+        -------
+        (numpy array, float)
+           The CDE loss for each bandwidth and the bandwidth with the
+           smallest loss.
+
+        Raises
+        ------
+        ValueError
+            If no test data is given and the forest was not fit with
+            out-of-bag samples, or if there are no bandwidths or any
+            isn't positive.
+        """
+        bandwidths = np.ascontiguousarray(bandwidths, dtype=float).reshape(-1)
+
+        if x_test is None:
+            wt_mat = self.oob_weights()
+            z_test = self.z_train
+        else:
+            # Coerce to matrices
+            if _is_arrow(z_test):
+                z_test = _arrow_to_numpy(z_test)
+            if len(z_test.shape) == 1:
+                z_test = z_test.reshape((len(z_test), 1))
+
+            n_test, rows = _rows(x_test)
+            wt_mat = np.zeros((n_test, self.z_train.shape[0]),
+                              dtype=self.forest.weight_dtype(), order="F")
+            for idx, x_row in enumerate(rows):
+                wt_mat[idx, :] = self.weights(x_row)
+
+        losses, best = kde_loss(np.asfortranarray(self.z_train, dtype=float),
+                                np.asfortranarray(z_test, dtype=float),
+                                wt_mat, bandwidths)
+        return losses, bandwidths[best]
+
     def variable_importance(self, type="count"):
         n_x = self.n_var
         imp = np.zeros(n_x)
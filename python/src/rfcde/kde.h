@@ -0,0 +1 @@
+../../../cpp/kde.h
\ No newline at end of file
@@ -6,6 +6,8 @@
 import numpy as np
 import statsmodels.api as sm
 
+from .ForestWrapper import weighted_bandwidth, BANDWIDTH_RULES
+
 def kde(responses, grid, weights, bandwidth):
     """Calculates the weighted kernel density estimate.
 
@@ -22,8 +24,10 @@ def kde(responses, grid, weights, bandwidth):
     bandwidth : numpy array or string
         The bandwidth for the kernel density estimate; array specifies
         the diagonal of the bandwidth matrix. Strings include
-        "scott", "silverman", and "normal_reference" for univariate densities and
-        "normal_reference", "cv_ml", and "cv_ls" for multivariate densities.
+        "plugin", "scott", and "silverman" for weighted rules
+        (any dimension), "normal_reference" for univariate densities
+        and "normal_reference", "cv_ml", and "cv_ls" for multivariate
+        densities.
 
     Returns
     -------
@@ -33,8 +37,17 @@ def kde(responses, grid, weights, bandwidth):
     """
     n_grid, n_dim = grid.shape
     n_obs, _ = responses.shape
+    # Forest weights may be narrow unsigned integers.
+    weights = np.asarray(weights, dtype=float)
     density = np.zeros(n_grid)
 
+    if isinstance(bandwidth, str) and bandwidth in BANDWIDTH_RULES:
+        bandwidth = weighted_bandwidth(np.asfortranarray(responses, dtype=float),
+                                       np.ascontiguousarray(weights, dtype=float),
+                                       bandwidth)
+        if n_dim == 1:
+            bandwidth = bandwidth[0]
+
     responses = responses[weights > 0, :]
     weights = weights[weights > 0]
 
@@ -42,9 +55,7 @@ def kde(responses, grid, weights, bandwidth):
         kde = sm.nonparametric.KDEUnivariate(responses[:, 0])
         kde.fit(bw = bandwidth, weights = weights.astype(float), fft = False)
         return kde.evaluate(grid[:, 0])
-    else:
-        if isinstance(bandwidth, (float, int)):
-            bandwidth = [bandwidth] * n_dim
+    elif isinstance(bandwidth, str):
         ## Doesn't take weights so just "resample"
         weights = weights * n_obs // sum(weights)
         ids = np.repeat(range(len(weights)), weights.astype(int))
@@ -52,3 +63,12 @@ def kde(responses, grid, weights, bandwidth):
                                                var_type = "c" * n_dim,
                                                bw = bandwidth)
         return kde.pdf(grid)
+    else:
+        ## Product Gaussian kernel evaluated directly with the weights
+        bandwidth = np.broadcast_to(np.asarray(bandwidth, dtype=float), (n_dim,))
+        weights = weights / float(sum(weights))
+        for idx in range(n_grid):
+            scaled = (grid[idx, :] - responses) / bandwidth
+            kernel = np.exp(-0.5 * np.sum(scaled ** 2, axis=1))
+            density[idx] = np.dot(weights, kernel)
+        return density / (np.prod(bandwidth) * (2 * np.pi) ** (n_dim / 2.0))
@@ -20,5 +20,5 @@ def weighted_quantile(x, weights, quantile):
     """
     perm = np.argsort(x)
     sorted_weights = weights[perm]
-    ecdf = np.cumsum(sorted_weights) / sum(weights)
+    ecdf = np.cumsum(sorted_weights, dtype=float) / np.sum(weights, dtype=float)
     return np.interp(quantile, ecdf, x[perm])
@@ -1,3 +1,6 @@
+import pickle
+from concurrent.futures import ThreadPoolExecutor
+
 import numpy as np
 import rfcde
 import pytest
@@ -18,3 +21,439 @@ def test_node_size_is_respected():
                              n_basis=n_basis)
         forest.train(x, z)
         assert sum(forest.weights(x[0, :])) >= min_size
+
+
+def test_sample_fraction_is_respected():
+    n = 1000
+    x = np.random.random((n, 1))
+    z = np.random.random(n)
+
+    forest = rfcde.RFCDE(n_trees=1, mtry=1, node_size=5, n_basis=15)
+    forest.train(x, z, sample_fraction=0.1)
+    wts = np.array([forest.weights(x[ii, :]) for ii in range(n)])
+    assert set(np.unique(wts)) <= {0, 1}
+    assert (wts.sum(0) > 0).sum() == 100
+
+
+def test_functional_training_points_reach_own_leaf():
+    n = 500
+    x = np.cumsum(np.random.random((n, 20)), axis=1)
+    z = np.random.random(n)
+    lens = np.array([5, 1, 14])
+
+    forest = rfcde.RFCDE(n_trees=1, mtry=3, node_size=1, n_basis=15)
+    forest.train(x, z, lens=lens, flambda=3.0, sample_fraction=1.0)
+    for ii in range(n):
+        assert forest.weights(x[ii, :])[ii] == 1
+
+
+def test_partition_pool_training_points_reach_own_leaf():
+    n = 300
+    x = np.cumsum(np.random.random((n, 20)), axis=1)
+    z = np.random.random(n)
+    lens = np.array([20])
+
+    for flambda in [0.01, 4.0]:
+        forest = rfcde.RFCDE(n_trees=4, mtry=3, node_size=1, n_basis=15)
+        forest.train(x, z, lens=lens, flambda=flambda, sample_fraction=1.0,
+                     n_partitions=2)
+        for ii in range(n):
+            assert forest.weights(x[ii, :])[ii] == 4
+
+
+def test_growth_limits_are_respected():
+    n = 1000
+    x = np.random.random((n, 2))
+    z = np.random.random(n)
+
+    def n_leaves(forest):
+        leaves = set()
+        for ii in range(n):
+            leaves.add(np.argmax(forest.weights(x[ii, :]) > 0))
+        return len(leaves)
+
+    forest = rfcde.RFCDE(n_trees=1, mtry=2, node_size=5, n_basis=15)
+    forest.train(x, z, sample_fraction=1.0, max_leaf_nodes=8)
+    assert n_leaves(forest) == 8
+
+    forest.train(x, z, sample_fraction=1.0, max_depth=2)
+    assert n_leaves(forest) <= 4
+
+    forest = rfcde.RFCDE(n_trees=100000, mtry=2, node_size=5, n_basis=15)
+    forest.train(x, z, max_time=0.01)
+    assert 1 <= forest.forest.n_trees() < 100000
+
+
+def test_add_trees_matches_single_training():
+    n = 500
+    x = np.random.random((n, 3))
+    z = np.random.random(n)
+    x_test = np.random.random((20, 3))
+
+    full = rfcde.RFCDE(n_trees=10, mtry=2, node_size=5, n_basis=15)
+    full.train(x, z, seed=7)
+
+    grown = rfcde.RFCDE(n_trees=4, mtry=2, node_size=5, n_basis=15)
+    grown.train(x, z, seed=7)
+    assert grown.add_trees(6) == 6
+    assert grown.forest.n_trees() == 10
+
+    for ii in range(x_test.shape[0]):
+        assert np.array_equal(full.weights(x_test[ii, :]),
+                              grown.weights(x_test[ii, :]))
+
+
+def test_add_observations_reach_own_leaf():
+    n = 300
+    x = np.random.random((n, 2))
+    z = np.random.random(n)
+    x_new = np.random.random((50, 2))
+    z_new = np.random.random(50)
+
+    forest = rfcde.RFCDE(n_trees=4, mtry=2, node_size=5, n_basis=15)
+    forest.train(x, z, sample_fraction=1.0)
+    # Batches land in buffers with spare rows.
+    for lo, hi in [(0, 10), (10, 30), (30, 50)]:
+        forest.add_observations(x_new[lo:hi], z_new[lo:hi])
+    assert np.array_equal(forest.z_train.reshape(-1), np.append(z, z_new))
+    with pytest.raises(ValueError):
+        forest.add_observations(x_new[:0], z_new[:0])
+    assert forest.z_train.shape[0] == n + 50
+
+    for ii in range(50):
+        weights = forest.weights(x_new[ii, :])
+        assert weights.shape[0] == n + 50
+        assert weights[n + ii] == 4
+
+    # Trees added later are grown on every observation.
+    forest.add_trees(2)
+    series = forest.predict_series(x_new, np.linspace(0, 1, 10))
+    assert np.all(np.isfinite(series))
+
+
+def test_retrained_forest_adds_observations_to_new_data():
+    x_old = np.random.random((200, 3))
+    z_old = np.random.random(200)
+    x = np.random.random((300, 2))
+    z = np.random.random(300)
+    x_new = np.random.random((40, 2))
+    z_new = np.random.random(40)
+    x_test = np.random.random((10, 2))
+
+    forest = rfcde.RFCDE(n_trees=4, mtry=2, node_size=5, n_basis=15)
+    forest.train(x_old, z_old, seed=3)
+    forest.add_observations(np.random.random((20, 3)), np.random.random(20))
+    forest.train(x, z, seed=3)
+    forest.add_observations(x_new, z_new)
+
+    fresh = rfcde.RFCDE(n_trees=4, mtry=2, node_size=5, n_basis=15)
+    fresh.train(x, z, seed=3)
+    fresh.add_observations(x_new, z_new)
+    assert np.array_equal(forest.z_train, fresh.z_train)
+    for ii in range(x_test.shape[0]):
+        assert np.array_equal(forest.weights(x_test[ii, :]),
+                              fresh.weights(x_test[ii, :]))
+
+
+def test_merge_matches_single_training_after_pickling():
+    n = 500
+    x = np.random.random((n, 3))
+    z = np.random.random(n)
+    x_test = np.random.random((20, 3))
+
+    first = rfcde.RFCDE(n_trees=4, mtry=2, node_size=5, n_basis=15)
+    first.train(x, z, seed=1)
+    second = rfcde.RFCDE(n_trees=6, mtry=2, node_size=5, n_basis=15)
+    second.train(x, z, seed=2)
+    expected = [first.weights(x_test[ii, :]) + second.weights(x_test[ii, :])
+                for ii in range(x_test.shape[0])]
+
+    merged = pickle.loads(pickle.dumps(first))
+    merged.merge(pickle.loads(pickle.dumps(second)))
+    assert merged.forest.n_trees() == 10
+    for ii in range(x_test.shape[0]):
+        assert np.array_equal(merged.weights(x_test[ii, :]), expected[ii])
+
+    with pytest.raises(ValueError):
+        merged.add_trees(1)
+
+    other = rfcde.RFCDE(n_trees=2, mtry=2, node_size=5, n_basis=15)
+    other.train(x + 1.0, z, seed=3)
+    with pytest.raises(ValueError):
+        merged.merge(other)
+
+    # Trees from the same seed would duplicate those already merged.
+    same = rfcde.RFCDE(n_trees=2, mtry=2, node_size=5, n_basis=15)
+    same.train(x, z, seed=1)
+    with pytest.raises(ValueError):
+        merged.merge(same)
+
+
+def test_deserialize_rejects_corrupt_indices():
+    n = 50
+    x = np.random.random((n, 2))
+    z = np.random.random(n)
+
+    forest = rfcde.RFCDE(n_trees=1, mtry=2, node_size=5, n_basis=5)
+    forest.train(x, z, seed=1)
+    data = forest.forest.serialize()
+
+    # Overwrite each word with an out-of-range index; streams that
+    # still load must be safe to predict from.
+    bad = np.int32(n + 5).tobytes()
+    for offset in range(len(data) - len(bad)):
+        loaded = type(forest.forest)()
+        try:
+            loaded.deserialize(data[:offset] + bad + data[offset + len(bad):])
+        except (ValueError, RuntimeError, MemoryError):
+            continue
+        assert loaded.weights(x[0, :]).shape[0] == n
+
+
+def test_forked_workers_match_single_process_training():
+    n = 500
+    x = np.random.random((n, 3))
+    z = np.random.random(n)
+    x_test = np.random.random((20, 3))
+
+    single = rfcde.RFCDE(n_trees=10, mtry=2, node_size=5, n_basis=15)
+    single.train(x, z, seed=7)
+
+    sharded = rfcde.RFCDE(n_trees=10, mtry=2, node_size=5, n_basis=15)
+    sharded.train(x, z, seed=7, n_workers=3)
+    assert sharded.forest.n_trees() == 10
+
+    for ii in range(x_test.shape[0]):
+        assert np.array_equal(single.weights(x_test[ii, :]),
+                              sharded.weights(x_test[ii, :]))
+
+
+def test_forked_budget_then_add_trees_grows_new_trees():
+    n = 500
+    x = np.random.random((n, 3))
+    z = np.random.random(n)
+    x_test = np.random.random((200, 3))
+
+    # Each worker trains only the first tree of its range.
+    forest = rfcde.RFCDE(n_trees=8, mtry=2, node_size=5, n_basis=15)
+    forest.train(x, z, seed=7, n_workers=2, max_time=1e-6)
+    assert forest.forest.n_trees() == 2
+
+    forest.add_trees(4)
+    forest.add_trees(4, max_time=1e-6)
+    assert forest.forest.n_trees() == 7
+    leaf_ids = forest.apply(x_test)
+    assert len(set(map(tuple, leaf_ids.T))) == 7
+
+    pickled = pickle.loads(pickle.dumps(forest))
+    assert np.array_equal(pickled.apply(x_test), leaf_ids)
+
+
+def test_concurrent_predictions_match_sequential():
+    n = 500
+    x = np.random.random((n, 3))
+    z = np.random.random(n)
+    x_test = np.random.random((40, 3))
+
+    forest = rfcde.RFCDE(n_trees=20, mtry=2, node_size=5, n_basis=15)
+    forest.train(x, z)
+    expected = [forest.weights(x_test[ii, :]) for ii in range(40)]
+
+    with ThreadPoolExecutor(max_workers=4) as pool:
+        weights = list(pool.map(forest.weights, x_test))
+    for ii in range(40):
+        assert np.array_equal(weights[ii], expected[ii])
+
+
+def test_training_layouts_and_dtypes_match():
+    n = 500
+    x = np.random.random((n, 3)).astype(np.float32)
+    z = np.random.random(n)
+    x_test = np.random.random((20, 3))
+
+    expected = rfcde.RFCDE(n_trees=5, mtry=2, node_size=5, n_basis=15)
+    expected.train(np.asfortranarray(x, dtype=np.float64), z, seed=7)
+
+    for x_train in [x, np.asfortranarray(x), x.astype(np.float64),
+                    np.repeat(x, 2, axis=1)[:, ::2]]:
+        forest = rfcde.RFCDE(n_trees=5, mtry=2, node_size=5, n_basis=15)
+        forest.train(x_train, z, seed=7)
+        for ii in range(x_test.shape[0]):
+            assert np.array_equal(forest.weights(x_test[ii, :]),
+                                  expected.weights(x_test[ii, :]))
+
+
+def test_arrow_batches_match_numpy():
+    pa = pytest.importorskip("pyarrow")
+    n = 500
+    x = np.random.random((n, 3))
+    z = np.random.random(n)
+    x_test = np.random.random((20, 3))
+    z_grid = np.linspace(0, 1, 10)
+
+    def batch(x):
+        return pa.record_batch([pa.array(x[:, jj]) for jj in range(3)],
+                               names=["a", "b", "c"])
+
+    expected = rfcde.RFCDE(n_trees=5, mtry=2, node_size=5, n_basis=15)
+    expected.train(x, z, seed=7)
+
+    # Slices are offset into the buffers of their batch.
+    padded = batch(np.vstack([np.zeros((1, 3)), x])).slice(1)
+    chunked = pa.Table.from_batches([batch(x[:200]), batch(x[200:])])
+    for x_train in [padded, chunked]:
+        forest = rfcde.RFCDE(n_trees=5, mtry=2, node_size=5, n_basis=15)
+        forest.train(x_train, pa.array(z), seed=7)
+        assert np.array_equal(forest.predict_mean(x_test),
+                              expected.predict_mean(x_test))
+
+    tests = pa.Table.from_batches([batch(x_test[:7]), batch(x_test[7:])])
+    assert np.array_equal(expected.predict_series(tests, z_grid),
+                          expected.predict_series(x_test, z_grid))
+
+    with pytest.raises(ValueError):
+        forest.train(pa.record_batch([pa.array([1.0, None])], names=["a"]),
+                     z[:2])
+
+
+def test_float32_training_points_reach_own_leaf():
+    n = 500
+    x = np.random.random((n, 2))
+    # Rows that only differ beyond float32 precision.
+    x[:10, :] = 1.0 + 1e-10 * np.arange(10)[:, None]
+    z = np.random.random(n)
+    x_new = np.random.random((20, 2))
+
+    forest = rfcde.RFCDE(n_trees=1, mtry=2, node_size=1, n_basis=15)
+    forest.train(x, z, sample_fraction=1.0, precision="float32")
+    forest.add_observations(x_new, np.random.random(20))
+
+    # Covariates keep their own precision; only the basis is float32.
+    x_all = np.vstack([x, x_new])
+    for ii in range(n + 20):
+        assert forest.weights(x_all[ii, :])[ii] == 1
+
+    with pytest.raises(ValueError):
+        forest.train(x, z, precision="float16")
+
+
+def test_narrow_weight_types_match():
+    n = 300
+    x = np.random.random((n, 2))
+    z = np.random.random(n)
+    x_test = np.random.random(2)
+
+    forest = rfcde.RFCDE(n_trees=10, mtry=2, node_size=5, n_basis=15)
+    forest.train(x, z, fit_oob=True)
+    assert forest.forest.weight_dtype() == np.uint16
+
+    weights = forest.weights(x_test)
+    assert weights.dtype == np.uint16
+    for dtype in [np.uint32, np.int64, np.float32]:
+        assert np.array_equal(forest.forest.weights(x_test, dtype=dtype),
+                              weights)
+    normalized = forest.forest.normalized_weights(x_test)
+    assert normalized.dtype == np.float32
+    assert np.allclose(normalized, weights / weights.sum())
+
+    oob = forest.oob_weights()
+    assert oob.dtype == np.uint16
+    assert np.array_equal(forest.forest.oob_weights(dtype=np.int64), oob)
+
+    with pytest.raises(ValueError):
+        forest.forest.weights(x_test, dtype=np.int8)
+
+
+def test_leaf_ids_reproduce_predictions():
+    n = 500
+    x = np.random.random((n, 2))
+    z = np.random.random(n)
+    x_test = np.random.random((20, 2))
+    z_grid = np.linspace(0, 1, 11)
+
+    forest = rfcde.RFCDE(n_trees=10, mtry=2, node_size=5, n_basis=15)
+    forest.train(x, z)
+    leaf_ids = forest.apply(x_test, n_threads=2)
+    assert leaf_ids.shape == (20, 10)
+    assert leaf_ids.dtype == np.intc
+    assert np.array_equal(forest.apply(x_test, n_threads=1), leaf_ids)
+
+    for idx in range(20):
+        assert np.array_equal(forest.forest.leaf_weights(leaf_ids[idx]),
+                              forest.weights(x_test[idx]))
+    assert np.allclose(forest.predict(None, z_grid, 0.1, leaf_ids=leaf_ids),
+                       forest.predict(x_test, z_grid, 0.1))
+    assert np.allclose(forest.predict_series(None, z_grid, leaf_ids=leaf_ids),
+                       forest.predict_series(x_test, z_grid))
+    assert np.allclose(forest.predict_mean(None, leaf_ids=leaf_ids),
+                       forest.predict_mean(x_test))
+
+    with pytest.raises(ValueError):
+        forest.forest.leaf_weights(leaf_ids[0] + 10000)
+
+
+def test_bitvector_engine_matches_traversal():
+    n = 500
+    x = np.random.random((n, 6))
+    z = np.random.random(n)
+    x_test = np.random.random((37, 6))
+    x_test[3, 1] = np.nan
+
+    forest = rfcde.RFCDE(n_trees=10, mtry=3, node_size=1, n_basis=15)
+    forest.train(x, z, lens=np.array([1, 1, 4]), flambda=2.0)
+    leaf_ids = forest.apply(x_test)
+    for n_threads in [1, 3]:
+        assert np.array_equal(forest.apply(x_test, n_threads=n_threads,
+                                           engine="bitvector"), leaf_ids)
+
+    forest.add_trees(5)
+    assert np.array_equal(forest.apply(x_test, engine="bitvector"),
+                          forest.apply(x_test))
+    with pytest.raises(ValueError):
+        forest.apply(x_test, engine="quickscorer")
+
+
+def test_lockstep_apply_matches_single_rows():
+    n = 500
+    x = np.random.random((n, 6))
+    z = np.random.random(n)
+    x_test = np.random.random((13, 6))
+    x_test[5, 4] = np.nan
+
+    for lens in [None, np.array([2, 4])]:
+        forest = rfcde.RFCDE(n_trees=5, mtry=3, node_size=1, n_basis=15)
+        forest.train(x, z, lens=lens, flambda=2.0)
+        leaf_ids = forest.apply(x_test)
+        for idx in range(13):
+            assert np.array_equal(forest.forest.leaf_weights(leaf_ids[idx]),
+                                  forest.weights(x_test[idx]))
+
+
+def test_compiled_forest_matches_apply(tmp_path):
+    n = 500
+    x = np.random.random((n, 6))
+    z = np.random.random(n)
+    x_test = np.random.random((20, 6))
+    x_test[2, 3] = np.nan
+
+    forest = rfcde.RFCDE(n_trees=5, mtry=3, node_size=5, n_basis=15)
+    forest.train(x, z, lens=np.array([1, 1, 4]), flambda=2.0)
+    compiled = forest.compile(str(tmp_path / "forest.so"))
+    leaf_ids = compiled.apply(x_test)
+    assert np.array_equal(leaf_ids, forest.apply(x_test))
+    assert np.allclose(forest.predict_mean(None, leaf_ids=leaf_ids),
+                       forest.predict_mean(x_test))
+
+    forest.add_trees(1)
+    with pytest.raises(ValueError):
+        rfcde.CompiledForest(str(tmp_path / "forest.so"), forest)
+
+    # Large trees are compiled as node tables.
+    n = 5000
+    x = np.random.random((n, 6))
+    z = np.random.random(n)
+    large = rfcde.RFCDE(n_trees=2, mtry=3, node_size=1, n_basis=15)
+    large.train(x, z, lens=np.array([1, 1, 4]), flambda=2.0)
+    assert "walk(tree_0_hi" in large.forest.generate_source()
+    compiled = large.compile(str(tmp_path / "large.so"))
+    assert np.array_equal(compiled.apply(x_test), large.apply(x_test))
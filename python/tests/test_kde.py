@@ -0,0 +1,37 @@
+import numpy as np
+import rfcde
+import pytest
+
+
+def test_weighted_bandwidth_ignores_weight_scale():
+    np.random.seed(42)
+    z = np.asfortranarray(np.random.normal(size=(1000, 2)))
+    weights = np.random.poisson(1.0, 1000).astype(float)
+
+    for rule in ["plugin", "silverman", "scott"]:
+        bandwidth = rfcde.kde.weighted_bandwidth(z, weights, rule)
+        scaled = rfcde.kde.weighted_bandwidth(z, 10.0 * weights, rule)
+        assert np.all(bandwidth > 0.0)
+        assert bandwidth == pytest.approx(scaled)
+
+
+def test_plugin_bandwidth_matches_normal_reference():
+    np.random.seed(42)
+    n_obs = 10000
+    z = np.asfortranarray(np.random.normal(size=(n_obs, 1)))
+
+    bandwidth = rfcde.kde.weighted_bandwidth(z, np.ones(n_obs), "plugin")
+    assert bandwidth[0] == pytest.approx(1.059 * n_obs ** -0.2, rel=0.1)
+
+
+def test_multivariate_kde_integrates_to_one():
+    np.random.seed(42)
+    z = np.random.random((200, 2))
+    weights = np.random.poisson(1.0, 200)
+
+    n_grid = 60
+    z1, z2 = np.meshgrid(np.linspace(-1, 2, n_grid), np.linspace(-1, 2, n_grid))
+    z_grid = np.array([z1.flatten(), z2.flatten()]).T
+    density = rfcde.kde.kde(z, z_grid, weights, "scott")
+
+    assert np.sum(density) * (3.0 / (n_grid - 1)) ** 2 == pytest.approx(1.0, abs=1e-2)
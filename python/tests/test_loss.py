@@ -0,0 +1,43 @@
+import numpy as np
+import rfcde
+import pytest
+
+
+def test_tuned_loss_matches_integrals():
+    np.random.seed(42)
+
+    n_train = 1000
+    n_test = 10
+    n_grid = 2000
+
+    x_train = np.random.random((n_train, 1))
+    z_train = np.random.normal(0, x_train[:, 0])
+    x_test = np.random.random((n_test, 1))
+    z_test = np.random.normal(0, x_test[:, 0])
+
+    forest = rfcde.RFCDE(n_trees=100, mtry=1, node_size=20, n_basis=15)
+    forest.train(x_train, z_train)
+
+    bandwidths = np.array([0.05, 0.1, 0.2])
+    losses, best = forest.tune_bandwidth(bandwidths, x_test, z_test)
+
+    z_grid = np.linspace(-4, 4, n_grid)
+    for ii, bandwidth in enumerate(bandwidths):
+        cdes = forest.predict(x_test, z_grid, bandwidth)
+        term1 = np.mean(np.trapz(cdes ** 2, z_grid))
+        term2 = np.mean([forest.predict(x_test[jj, :], z_test[jj:(jj + 1)],
+                                        bandwidth)[0, 0]
+                         for jj in range(n_test)])
+        assert losses[ii] == pytest.approx(term1 - 2 * term2, abs=1e-2)
+    assert best == bandwidths[np.argmin(losses)]
+
+
+def test_tuning_rejects_invalid_bandwidths():
+    x_train = np.random.random((100, 1))
+    z_train = np.random.random(100)
+
+    forest = rfcde.RFCDE(n_trees=10, mtry=1, node_size=5, n_basis=15)
+    forest.train(x_train, z_train, fit_oob=True)
+    for bandwidths in [[], [0.1, 0.0], [-0.1], [np.nan]]:
+        with pytest.raises(ValueError):
+            forest.tune_bandwidth(np.array(bandwidths))
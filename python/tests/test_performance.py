@@ -1,3 +1,5 @@
+import time
+
 import numpy as np
 import rfcde
 import pytest
@@ -58,3 +60,118 @@ def test_beta_example_performance():
     z_grid = np.linspace(0, 1, n_grid)
     density = forest.predict(x_test, z_grid, bandwidth)
     assert cde_loss(density, z_grid, z_test) < -1.8
+
+
+def test_beta_example_series_performance():
+    np.random.seed(42)
+
+    def generate_data(n):
+        x = 5.0 * np.random.random((n, 2))
+        z = np.random.beta(x[:, 0] + 5, x[:, 1] + 5, n)
+        return x, z
+
+    x_train, z_train = generate_data(1000)
+    x_test, z_test = generate_data(1000)
+
+    n_trees = 100
+    mtry = 2
+    min_size = 20
+    n_basis = 15
+
+    forest = rfcde.RFCDE(n_trees=n_trees,
+                         mtry=mtry,
+                         node_size=min_size,
+                         n_basis=n_basis)
+    forest.train(x_train, z_train)
+
+    n_grid = 1000
+    z_grid = np.linspace(0, 1, n_grid)
+    density = forest.predict_series(x_test, z_grid)
+    assert cde_loss(density, z_grid, z_test) < -1.8
+
+
+def test_beta_example_random_split_performance():
+    np.random.seed(42)
+
+    def generate_data(n):
+        x = 5.0 * np.random.random((n, 2))
+        z = np.random.beta(x[:, 0] + 5, x[:, 1] + 5, n)
+        return x, z
+
+    x_train, z_train = generate_data(1000)
+    x_test, z_test = generate_data(1000)
+
+    n_trees = 100
+    mtry = 2
+    min_size = 20
+    n_basis = 15
+    bandwidth = 0.1
+
+    forest = rfcde.RFCDE(n_trees=n_trees,
+                         mtry=mtry,
+                         node_size=min_size,
+                         n_basis=n_basis)
+    forest.train(x_train, z_train, split_mode="random", n_thresholds=3)
+
+    n_grid = 1000
+    z_grid = np.linspace(0, 1, n_grid)
+    density = forest.predict(x_test, z_grid, bandwidth)
+    assert cde_loss(density, z_grid, z_test) < -1.8
+
+
+def test_beta_example_float32_performance():
+    np.random.seed(42)
+
+    def generate_data(n):
+        x = 5.0 * np.random.random((n, 2))
+        z = np.random.beta(x[:, 0] + 5, x[:, 1] + 5, n)
+        return x, z
+
+    x_train, z_train = generate_data(1000)
+    x_test, z_test = generate_data(1000)
+
+    n_grid = 1000
+    z_grid = np.linspace(0, 1, n_grid)
+    losses = {}
+    times = {}
+    for precision in ["float64", "float32"]:
+        forest = rfcde.RFCDE(n_trees=100, mtry=2, node_size=20, n_basis=15)
+        start = time.perf_counter()
+        forest.train(x_train, z_train, seed=42, precision=precision)
+        times[precision] = time.perf_counter() - start
+        density = forest.predict_series(x_test, z_grid)
+        losses[precision] = cde_loss(density, z_grid, z_test)
+
+    # float32 storage keeps the accuracy of the double forest; the
+    # timing bound only guards against a pathological slowdown.
+    assert losses["float32"] < -1.8
+    assert abs(losses["float32"] - losses["float64"]) < 0.02
+    assert times["float32"] < 2.0 * times["float64"] + 0.5
+
+
+def test_beta_example_bitvector_engine():
+    np.random.seed(42)
+
+    def generate_data(n):
+        x = 5.0 * np.random.random((n, 2))
+        z = np.random.beta(x[:, 0] + 5, x[:, 1] + 5, n)
+        return x, z
+
+    x_train, z_train = generate_data(2000)
+    x_test, _ = generate_data(2000)
+
+    forest = rfcde.RFCDE(n_trees=100, mtry=2, node_size=5, n_basis=15)
+    forest.train(x_train, z_train, seed=42, max_depth=20)
+    leaf_ids = {}
+    times = {}
+    for engine in ["traverse", "bitvector"]:
+        forest.apply(x_test[:10], n_threads=1, engine=engine)
+        start = time.perf_counter()
+        leaf_ids[engine] = forest.apply(x_test, n_threads=1, engine=engine)
+        times[engine] = time.perf_counter() - start
+
+    # Deep trees fail many conditions per row so the bitvector engine
+    # is not expected to win here; the bound only guards against a
+    # pathological slowdown.
+    assert np.array_equal(leaf_ids["bitvector"], leaf_ids["traverse"])
+    assert times["bitvector"] < 5.0 * times["traverse"] + 0.5
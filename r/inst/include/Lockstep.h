@@ -0,0 +1 @@
+../../../cpp/Lockstep.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../cpp/Serialize.h
\ No newline at end of file
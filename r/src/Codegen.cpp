@@ -0,0 +1 @@
+../../cpp/Codegen.cpp
\ No newline at end of file
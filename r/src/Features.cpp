@@ -0,0 +1 @@
+../../cpp/Features.cpp
\ No newline at end of file
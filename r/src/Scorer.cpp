@@ -0,0 +1 @@
+../../cpp/Scorer.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../cpp/kde.cpp
\ No newline at end of file
@@ -1,12 +1,46 @@
 // Copyright Taylor Pospisil 2018.
 // Distributed under MIT License (http://opensource.org/licenses/MIT)
-#include <Rcpp.h>
+#include <RcppCommon.h>
 
 #include "Tree.h"
 #include "Forest.h"
+#include "kde.h"
+
+// Allows forests to be passed to merge.
+class ForestRcpp;
+RCPP_EXPOSED_CLASS(ForestRcpp)
+
+#include <Rcpp.h>
 
 using namespace Rcpp;
 
+namespace {
+  template<class T>
+  void move_rows(std::vector<T>& buffer, int capacity, int n_rows,
+                 int grown) {
+    // Reallocates a column-major buffer with grown rows per column,
+    // keeping its first n_rows rows.
+    size_t n_cols = capacity ? buffer.size() / capacity : 0;
+    std::vector<T> out(static_cast<size_t>(grown) * n_cols);
+    for (size_t jj = 0; jj < n_cols; jj++) {
+      std::copy(buffer.begin() + jj * capacity,
+                buffer.begin() + jj * capacity + n_rows,
+                out.begin() + jj * grown);
+    }
+    buffer.swap(out);
+  }
+
+  template<class T>
+  void copy_rows(std::vector<T>& buffer, int capacity, int n_rows,
+                 NumericMatrix rows) {
+    // Writes rows below the first n_rows rows of a column-major buffer.
+    for (int jj = 0; jj < rows.ncol(); jj++) {
+      std::copy(rows.column(jj).begin(), rows.column(jj).end(),
+                buffer.begin() + static_cast<size_t>(jj) * capacity + n_rows);
+    }
+  }
+}
+
 //' @name ForestRcpp
 //' @title Fit a random forest for CDE
 //'
@@ -23,21 +57,152 @@ using namespace Rcpp;
 class ForestRcpp {
 private:
   Forest obj;
+  // Training data referenced by obj for add_trees; a float copy of
+  // the basis evaluations replaces z_basis when trained in single
+  // precision. Once observations are added the remaining R matrices
+  // are copied into x_double and z_double. Buffers hold capacity rows
+  // per column so that appending only copies the new rows, amortized.
+  NumericMatrix x_train;
+  NumericMatrix z_basis;
+  std::vector<double> x_double;
+  std::vector<double> z_double;
+  std::vector<float> z_single;
+  bool single = false;
+  int n_train = 0;
+  int capacity = 0;
+
+  template<class T>
+  void append(std::vector<T>& z_buffer, NumericMatrix x_new,
+              NumericMatrix z_basis_new) {
+    int n_old = n_train;
+    int n_train = n_old + x_new.nrow();
+    if (n_train > capacity) {
+      int grown = std::max(n_train, 2 * capacity);
+      move_rows(x_double, capacity, n_old, grown);
+      move_rows(z_buffer, capacity, n_old, grown);
+      capacity = grown;
+    }
+    copy_rows(x_double, capacity, n_old, x_new);
+    copy_rows(z_buffer, capacity, n_old, z_basis_new);
+    obj.add_observations(MatrixView::column_major(x_double.data(), capacity),
+                         MatrixView::column_major(z_buffer.data(), capacity),
+                         n_train);
+    this -> n_train = n_train;
+  }
 public:
   void train(NumericMatrix x_train, NumericMatrix z_basis, IntegerVector lens, int n_trees,
-             int mtry, int node_size, double min_loss_delta, double flambda, bool fit_oob) {
+             int mtry, int node_size, double min_loss_delta, double flambda, bool fit_oob,
+             int split_mode, int n_thresholds, double sample_fraction,
+             int n_partitions, int max_depth, int max_leaf_nodes,
+             double max_time, int seed, int n_workers, bool single) {
     int n_train = x_train.nrow();
     int n_var = x_train.ncol();
     int n_basis = z_basis.ncol();
 
-    obj.train(&x_train(0,0), &z_basis(0,0), &lens(0), n_train, n_var, n_basis,
-              n_trees, mtry, node_size, min_loss_delta, flambda, fit_oob);
+    this -> single = single;
+    this -> x_train = x_train;
+    x_double.clear();
+    z_double.clear();
+    z_single.clear();
+    MatrixView z_view;
+    if (single) {
+      this -> z_basis = NumericMatrix();
+      z_single.assign(z_basis.begin(), z_basis.end());
+      z_view = MatrixView::column_major(z_single.data(), n_train);
+    } else {
+      this -> z_basis = z_basis;
+      z_view = MatrixView::column_major(&z_basis(0,0), n_train);
+    }
+    obj.train(MatrixView::column_major(&x_train(0,0), n_train), z_view,
+              &lens(0), n_train, n_var, n_basis,
+              n_trees, mtry, node_size, min_loss_delta, flambda, fit_oob,
+              split_mode, n_thresholds, sample_fraction, n_partitions,
+              max_depth, max_leaf_nodes, max_time, seed, n_workers);
+    this -> n_train = n_train;
+    this -> capacity = n_train;
+  };
+
+  int add_trees(int n_trees, double max_time) {
+    if (n_train == 0) {
+      stop("Forest must be trained before adding trees");
+    }
+    return obj.add_trees(n_trees, max_time);
+  };
+
+  void add_observations(NumericMatrix x_new, NumericMatrix z_basis_new) {
+    if (n_train == 0) {
+      stop("Forest must be trained before adding observations");
+    }
+    if (x_double.empty()) {
+      x_double.assign(x_train.begin(), x_train.end());
+      x_train = NumericMatrix();
+      if (!single) {
+        z_double.assign(z_basis.begin(), z_basis.end());
+        z_basis = NumericMatrix();
+      }
+    }
+    if (single) {
+      append(z_single, x_new, z_basis_new);
+    } else {
+      append(z_double, x_new, z_basis_new);
+    }
+  };
+
+  void merge(ForestRcpp& other) {
+    obj.merge(other.obj);
+  };
+
+  RawVector serialize() {
+    std::string data = obj.serialize();
+    return RawVector(data.begin(), data.end());
+  };
+
+  void deserialize(RawVector data) {
+    obj.deserialize(std::string(data.begin(), data.end()));
+    x_train = NumericMatrix();
+    z_basis = NumericMatrix();
+    x_double.clear();
+    z_double.clear();
+    z_single.clear();
+    n_train = 0;
+    capacity = 0;
+  };
+
+  int n_trees() {
+    return obj.n_trees();
   };
 
   void fill_weights(Rcpp::NumericVector x_test, Rcpp::IntegerVector weights) {
     obj.fill_weights(&x_test(0), &weights(0));
   };
 
+  void fill_series_cde(Rcpp::NumericVector x_test,
+                       Rcpp::NumericMatrix grid_basis,
+                       Rcpp::NumericVector cde) {
+    obj.predict_series_cde(&x_test(0), &grid_basis(0,0), grid_basis.nrow(),
+                           &cde(0));
+  };
+
+  Rcpp::IntegerMatrix apply(Rcpp::NumericMatrix x_test, int n_threads) {
+    // Leaf ids are filled row-major so the result is transposed; each
+    // column holds the leaf ids of an observation.
+    Rcpp::IntegerMatrix leaf_ids(obj.n_trees(), x_test.nrow());
+    if (x_test.nrow() > 0 && obj.n_trees() > 0) {
+      obj.apply(MatrixView::column_major(&x_test(0,0), x_test.nrow()),
+                x_test.nrow(), &leaf_ids(0,0), n_threads);
+    }
+    return leaf_ids;
+  };
+
+  void fill_leaf_weights(Rcpp::IntegerVector leaf_row,
+                         Rcpp::IntegerVector weights) {
+    if (leaf_row.size() != obj.n_trees() ||
+        !obj.valid_leaf_ids(&leaf_row(0), 1)) {
+      Rcpp::stop("Leaf ids do not match the forest.");
+    }
+    obj.fill_leaf_weights(&leaf_row(0), &weights(0));
+  };
+
   void fill_oob_weights(Rcpp::IntegerMatrix weights) {
     obj.fill_oob_weights(&weights(0,0));
   };
@@ -51,11 +216,73 @@ public:
   };
 };
 
+//' @name kde_loss_curve
+//' @title Calculate KDE loss for candidate bandwidths
+//'
+//' @description Provides a wrapper to the C++ bandwidth tuner;
+//'   pairwise distances are shared across all bandwidths.
+//'
+//' @param z_train a matrix of training responses.
+//' @param z_test a matrix of test responses.
+//' @param weights a matrix of weights; each row corresponds to a test
+//'   point and each column to a training point.
+//' @param bandwidths a vector of candidate bandwidths.
+//' @return A list with the loss for each bandwidth and the index of
+//'   the best bandwidth.
+List kde_loss_curve_rcpp(NumericMatrix z_train, NumericMatrix z_test,
+                         NumericMatrix weights, NumericVector bandwidths) {
+  if (bandwidths.size() < 1) {
+    stop("At least one bandwidth is required");
+  }
+  for (int bb = 0; bb < bandwidths.size(); bb++) {
+    if (!(bandwidths[bb] > 0.0)) {
+      stop("Bandwidths must be positive");
+    }
+  }
+  NumericVector loss(bandwidths.size());
+  int best = kde_loss_curve(&z_train(0,0), &z_test(0,0), &weights(0,0),
+                            z_train.nrow(), z_test.nrow(), z_train.ncol(),
+                            &bandwidths(0), bandwidths.size(), &loss(0));
+  return List::create(Named("loss") = loss, Named("best") = best + 1);
+}
+
+//' @name weighted_bandwidth
+//' @title Select a KDE bandwidth from weighted responses
+//'
+//' @description Provides a wrapper to the C++ bandwidth selectors;
+//'   rows are never replicated by weight.
+//'
+//' @param z_train a matrix of training responses.
+//' @param weights a vector of weights for the training responses.
+//' @param rule the bandwidth rule; 0 for plug-in, 1 for Silverman's
+//'   rule and 2 for Scott's rule.
+//' @return A vector with the bandwidth for each response dimension.
+NumericVector weighted_bandwidth_rcpp(NumericMatrix z_train,
+                                      NumericVector weights, int rule) {
+  NumericVector bandwidth(z_train.ncol());
+  select_bandwidth(&z_train(0,0), &weights(0), z_train.nrow(), z_train.ncol(),
+                   rule, &bandwidth(0));
+  return bandwidth;
+}
+
 RCPP_MODULE(RFCDEModule) {
+  function("kde_loss_curve", &kde_loss_curve_rcpp);
+  function("weighted_bandwidth", &weighted_bandwidth_rcpp);
+
+
   class_<ForestRcpp>("ForestRcpp")
     .constructor()
     .method("train", &ForestRcpp::train)
+    .method("add_trees", &ForestRcpp::add_trees)
+    .method("add_observations", &ForestRcpp::add_observations)
+    .method("merge", &ForestRcpp::merge)
+    .method("serialize", &ForestRcpp::serialize)
+    .method("deserialize", &ForestRcpp::deserialize)
+    .method("n_trees", &ForestRcpp::n_trees)
     .method("fill_weights", &ForestRcpp::fill_weights)
+    .method("fill_series_cde", &ForestRcpp::fill_series_cde)
+    .method("apply", &ForestRcpp::apply)
+    .method("fill_leaf_weights", &ForestRcpp::fill_leaf_weights)
     .method("fill_oob_weights", &ForestRcpp::fill_oob_weights)
     .method("fill_loss_importance", &ForestRcpp::fill_loss_importance)
     .method("fill_count_importance", &ForestRcpp::fill_count_importance)